@@ -37,7 +37,7 @@ istruct (App) {
     Bool toggle;
 
     I64 intval;
-    Texture image;
+    DrImage *image;
 
     F32 hue;
     F32 sat;
@@ -302,7 +302,7 @@ Void view_misc_build (UiViewInstance *instance, Bool visible) {
             ui_tag("hbox");
             ui_tag("item");
 
-            UiBox *img = ui_image("image", &app->image, false, vec4(0,0,0,0), 200);
+            UiBox *img = ui_image("image", app->image, false, vec4(0,0,0,0), 200);
             UiBox *img_overlay = array_get(&img->children, 0);
             ui_style_box_f32(img_overlay, UI_OUTSET_SHADOW_WIDTH, 2);
             ui_style_box_vec4(img_overlay, UI_OUTSET_SHADOW_COLOR, vec4(0, 0, 0, 1));
@@ -349,7 +349,7 @@ Void app_init () {
     app = mem_new(ui->perm_mem, App);
 
     app->view = 3;
-    app->image = dr_image("data/images/screenshot.png", false);
+    app->image = dr_image_load("data/images/screenshot.png", false);
     app->slider = .5;
     app->buf1 = buf_new_from_file(ui->perm_mem, str("/home/zagor/Documents/test.txt"));
     app->buf2 = buf_new(ui->perm_mem, str(""));
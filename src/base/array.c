@@ -48,7 +48,7 @@ Void uarray_ensure_count (UArray *array, U64 esize, U64 n, Bool zeroed) {
 
 Void *uarray_push (UArray *array, U64 esize) {
     if (array->count == array->capacity) {
-        U64 new_cap = array->capacity ? cast(U64, 1.8 * array->capacity) : 2;
+        U64 new_cap = array->capacity ? max(cast(U64, 1.8 * array->capacity), array->capacity + 1) : 2;
         assert_always(new_cap > array->capacity);
         uarray_increase_capacity(array, esize, new_cap);
     }
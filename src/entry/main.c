@@ -6,6 +6,7 @@
 #include "os/time.h"
 #include "base/log.h"
 #include "ui/ui.h"
+#include "font/font.h"
 #include "app/app.h"
 #include "window/window.h"
 
@@ -13,11 +14,27 @@ istruct (CmdLine) {
     U64 cursor;
     SliceCString args;
     String main_file_path;
+    Bool software;
+    Bool gpu_profile;
+    Bool dump_cmds;
+    Bool stats;
+    String bench_shaping; // Path of the text to shape.
+    String dump_frame; // Path of the PNG.
+    String compare_frame; // Path of the PNG.
 };
 
+static CmdLine cli;
+
 static Void cli_print_options () {
     printf(
-        "-h        Print command line options.\n"
+        "-h                    Print command line options.\n"
+        "-software             Render on the CPU instead of with OpenGL.\n"
+        "-gpu-profile          Log the GPU time of the render passes every frame.\n"
+        "-dump-cmds            Log the draw commands of the first frame before and after sorting.\n"
+        "-stats                Show fps, upload size, skipped frames and latency in the window title.\n"
+        "-bench-shaping <file> Log how fast the text in the file is shaped and exit.\n"
+        "-dump-frame <file>    Write the frame to a PNG and exit once nothing is animating or loading.\n"
+        "-compare-frame <file> Like -dump-frame but compare the frame with a PNG and exit with 1 if it differs.\n"
     );
 }
 
@@ -44,6 +61,20 @@ static CmdLine cli_parse (Int argc, CString *argv) {
 
         if (str_match(arg, str("-h"))) {
             cli_print_options();
+        } else if (str_match(arg, str("-software"))) {
+            cli.software = true;
+        } else if (str_match(arg, str("-gpu-profile"))) {
+            cli.gpu_profile = true;
+        } else if (str_match(arg, str("-dump-cmds"))) {
+            cli.dump_cmds = true;
+        } else if (str_match(arg, str("-stats"))) {
+            cli.stats = true;
+        } else if (str_match(arg, str("-bench-shaping"))) {
+            cli.bench_shaping = cli_eat(&cli, "Expected a file path after -bench-shaping.");
+        } else if (str_match(arg, str("-dump-frame"))) {
+            cli.dump_frame = cli_eat(&cli, "Expected a file path after -dump-frame.");
+        } else if (str_match(arg, str("-compare-frame"))) {
+            cli.compare_frame = cli_eat(&cli, "Expected a file path after -compare-frame.");
         } else {
             log_msg_fmt(LOG_ERROR, "", 1, "Unknown command line argument '%.*s'.", STR(arg));
         }
@@ -51,12 +82,12 @@ static CmdLine cli_parse (Int argc, CString *argv) {
         if (ls->count[LOG_ERROR]) break;
     }
 
-    if (cli.args.count == 1) cli_print_options();
     return cli;
 }
 
 static Void fn (F64 dt) {
     ui_frame(app_build, dt);
+    if (cli.gpu_profile) dr_log_gpu_timings();
 }
 
 Int main (Int argc, CString *argv) {
@@ -65,10 +96,24 @@ Int main (Int argc, CString *argv) {
     log_setup(mem_root, 4*KB);
     log_scope(ls, 1);
  
-    // cli_parse(argc, argv);
+    cli = cli_parse(argc, argv);
 
-    win_init("Mimui");
+    win_init("Mimui", cli.software ? DR_BACKEND_SOFTWARE : DR_BACKEND_GL);
+    if (cli.gpu_profile) dr_gpu_profile(true);
+    if (cli.dump_cmds) dr_dump_cmds();
+    if (cli.stats) win_show_stats(true);
+    if (cli.dump_frame.count) win_dump_frame(cstr(mem_root, cli.dump_frame));
+    if (cli.compare_frame.count) win_compare_frame(cstr(mem_root, cli.compare_frame));
     ui_init();
+
+    if (cli.bench_shaping.count) {
+        String text = fs_read_entire_file(mem_root, cli.bench_shaping, 0);
+        if (! text.data) { log_msg_fmt(LOG_ERROR, "", 1, "Couldn't read file '%.*s'.", STR(cli.bench_shaping)); return 1; }
+        font_benchmark_shaping(font_get(ui->font_cache, str("data/fonts/FiraMono-Bold Powerline.otf"), 12, true), text); // The font of the editor.
+        return 0;
+    }
+
     app_init();
     win_run(fn);
+    return win_frame_matched() ? 0 : 1;
 }
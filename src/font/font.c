@@ -1,5 +1,7 @@
+#include <inttypes.h>
 #include <freetype/freetype.h>
 #include <freetype/ftmodapi.h>
+#include <hb-ot.h>
 #include "vendor/plutosvg/src/plutosvg.h"
 #include "font/font.h"
 #include "base/array.h"
@@ -8,167 +10,388 @@
 #include "base/map.h"
 #include "os/fs.h"
 #include "os/time.h"
+#include "os/threads.h"
 #include "window/window.h"
 
 #define LOG_HEADER "Font"
 
-AtlasSlot *font_get_atlas_slot (Font *font, GlyphInfo *info) {
-    AtlasSlot *slot = map_get_ptr(&font->slot_map, info->glyph_index);
+istruct (RasterWorker) {
+    FT_Library ft_lib;
+    Array(FT_Face) faces; // Indexed by Font.id. Opened when first needed.
+};
+
+istruct (GlyphRaster) {
+    Font *font;
+    AtlasSlot *slot;
+    U32 glyph_index;
+    U32 width;
+    U32 height;
+    I32 bearing_x;
+    I32 bearing_y;
+    FT_Pixel_Mode pixel_mode;
+    U8 *pixels; // RGBA of the rect with the border. Null if the glyph has none.
+    CString error; // Logged by place_rasterized_glyphs() since workers have no log scope.
+};
+
+static FT_Library new_ft_library () {
+    FT_Library ft_lib;
+    FT_Init_FreeType(&ft_lib);
+    Auto hooks = plutosvg_ft_svg_hooks();
+    FT_Property_Set(ft_lib, "ot-svg", "svg-hooks", hooks);
+    return ft_lib;
+}
+
+static FT_Face open_face (FT_Library ft_lib, Font *font) {
+    FT_Face face = 0;
+    FT_Open_Args args = { .flags=FT_OPEN_MEMORY, .memory_base=cast(U8*, font->binary.data), .memory_size=font->binary.count };
+    FT_Open_Face(ft_lib, &args, 0, &face);
+    FT_Set_Pixel_Sizes(face, 0, font->size);
+    return face;
+}
 
-    Bool atlas_update_needed = true;
+static TPOOL_FN(rasterize_glyph) {
+    GlyphRaster *raster = arg;
+    Font *font = raster->font;
+    FontCache *cache = font->cache;
+    RasterWorker *worker = &cache->raster_workers[worker_id];
 
-    // Remove from lru chain.
-    if (slot) {
-        slot->lru_next->lru_prev = slot->lru_prev;
-        slot->lru_prev->lru_next = slot->lru_next;
-        atlas_update_needed = false;
+    if (! worker->ft_lib) {
+        worker->ft_lib = new_ft_library();
+        array_init(&worker->faces, mem_root);
     }
 
-    // See if we have a free slot.
-    if (!slot && font->free_slots.count) {
-        slot = array_pop(&font->free_slots);
-        slot->glyph_index = info->glyph_index;
-        map_add(&font->slot_map, info->glyph_index, slot);
+    array_ensure_count(&worker->faces, font->id + 1, true);
+    FT_Face face = array_get(&worker->faces, font->id);
+    if (! face) array_set(&worker->faces, font->id, (face = open_face(worker->ft_lib, font)));
+
+    if (FT_Load_Glyph(face, raster->glyph_index, FT_LOAD_RENDER | (FT_HAS_COLOR(face) ? FT_LOAD_COLOR : 0))) {
+        raster->error = "Couldn't load/render font glyph.";
+        goto done;
     }
 
-    // Evict the lru slot.
-    if (! slot) {
-        if (font->cache->vertex_flush_fn) font->cache->vertex_flush_fn();
-        assert_dbg(font->lru.lru_prev != &font->lru);
-        slot = font->lru.lru_prev;
-        map_remove(&font->slot_map, slot->glyph_index);
-        slot->glyph_index = info->glyph_index;
-        map_add(&font->slot_map, info->glyph_index, slot);
+    Auto ft_glyph = face->glyph;
+    Auto ft_bitmap = ft_glyph->bitmap;
+    Auto w = ft_bitmap.width;
+    Auto h = ft_bitmap.rows;
+
+    raster->width = w;
+    raster->height = h;
+    raster->bearing_x = ft_glyph->bitmap_left;
+    raster->bearing_y = ft_glyph->bitmap_top;
+    raster->pixel_mode = ft_bitmap.pixel_mode;
+
+    if ((w == 0) || (h == 0)) {
+        goto done;
     }
 
-    // Mark as mru slot
-    slot->lru_next = font->lru.lru_next;
-    slot->lru_prev = &font->lru;
-    font->lru.lru_next->lru_prev = slot;
-    font->lru.lru_next = slot;
+    U32 rect_w = w + 2;
+    U32 rect_h = h + 2;
 
-    if (atlas_update_needed) {
-        tmem_new(tm);
+    if ((rect_w > FONT_ATLAS_PAGE_SIZE) || (rect_h > FONT_ATLAS_PAGE_SIZE)) {
+        raster->error = "Font glyph too big to fit into an atlas page.";
+        goto done;
+    }
 
-        if (FT_Load_Glyph(font->ft_face, slot->glyph_index, FT_LOAD_RENDER | (FT_HAS_COLOR(font->ft_face) ? FT_LOAD_COLOR : 0))) {
-            log_msg_fmt(LOG_ERROR, LOG_HEADER, 0, "Couldn't load/render font glyph.");
-            goto done;
+    U8 *buf = mem_alloc(mem_root, U8, .zeroed=true, .size=(rect_w * rect_h * 4));
+    raster->pixels = buf;
+
+    switch (ft_bitmap.pixel_mode) {
+    case FT_PIXEL_MODE_GRAY: {
+        for (U32 y = 0; y < h; ++y) {
+            U8 *src = ft_bitmap.buffer + y * abs(ft_bitmap.pitch);
+            for (U32 x = 0; x < w; ++x) {
+                U8 value = src[x];
+                U32 i = ((y + 1) * rect_w + x + 1) * 4;
+                buf[i + 0] = 255;
+                buf[i + 1] = 255;
+                buf[i + 2] = 255;
+                buf[i + 3] = value;
+            }
         }
+    } break;
+
+    case FT_PIXEL_MODE_BGRA: {
+        for (U32 y = 0; y < h; ++y) {
+            U8 *src = ft_bitmap.buffer + y * abs(ft_bitmap.pitch);
+            for (U32 x = 0; x < w; ++x) {
+                U32 i = ((y + 1) * rect_w + x + 1) * 4;
+                buf[i + 0] = src[x * 4 + 2];
+                buf[i + 1] = src[x * 4 + 1];
+                buf[i + 2] = src[x * 4 + 0];
+                buf[i + 3] = src[x * 4 + 3];
+            }
+        }
+    } break;
+
+    default: badpath;
+    }
+
+    done: {
+        os_mutex_scoped_lock(cache->raster_mutex);
+        array_push(&cache->rasterized, raster);
+    }
+
+    // One wake per batch of glyphs is enough since they are all
+    // placed by the same font_cache_trim(), which clears the flag.
+    if (! atomic_exchange(&cache->wake_pending, true)) win_wake();
+}
+
+static Void add_atlas_page (FontCache *cache) {
+    Auto page = mem_new(cache->mem, AtlasPage);
+    page->texture = dr_2d_texture_alloc(FONT_ATLAS_PAGE_SIZE, FONT_ATLAS_PAGE_SIZE);
+    array_init(&page->shelves, cache->mem);
+    array_init(&page->slots, cache->mem);
+    array_push(&cache->atlas_pages, page);
+}
+
+static Void evict_atlas_page (FontCache *cache, AtlasPage *page) {
+    array_iter (slot, &page->slots) {
+        map_remove(&cache->atlas_map, slot->key);
+        array_push(&cache->free_atlas_slots, slot);
+    }
+
+    cache->atlas_page_evictions++;
+    cache->atlas_glyph_evictions += page->slots.count;
+    page->slots.count = 0;
+    page->shelves.count = 0;
+    page->used_height = 0;
+    page->used_area = 0;
+}
+
+// The rect goes on the lowest shelf with room for it that is at
+// most a quarter taller than it. Otherwise a shelf of the same
+// height as the rect is started below the others.
+static Bool pack_in_atlas_page (AtlasPage *page, U32 w, U32 h, U16 *out_x, U16 *out_y) {
+    AtlasShelf *best = 0;
+
+    array_iter (shelf, &page->shelves, *) {
+        if (shelf->height < h || shelf->height > h + h/4) continue;
+        if (FONT_ATLAS_PAGE_SIZE - shelf->used_width < w) continue;
+        if (!best || shelf->height < best->height) best = shelf;
+    }
+
+    if (! best) {
+        if (FONT_ATLAS_PAGE_SIZE - page->used_height < h) return false;
+        array_push_lit(&page->shelves, .y=page->used_height, .height=h);
+        page->used_height += h;
+        best = array_ref_last(&page->shelves);
+    }
+
+    *out_x = best->used_width;
+    *out_y = best->y;
+    best->used_width += w;
+    page->used_area += w * h;
+    return true;
+}
+
+// Pages are tried in the order they were added in. If none has
+// room a page is added, or once there are FONT_ATLAS_MAX_PAGES
+// the least recently used one is emptied. Pages used in the
+// current tick hold glyphs of the frame that was just drawn and
+// likely of the next one too, so evicting one would make visible
+// text blink. If all pages are in use like that, a page is added
+// past the max instead.
+static AtlasPage *alloc_atlas_rect (FontCache *cache, U32 w, U32 h, U16 *out_x, U16 *out_y) {
+    array_iter (page, &cache->atlas_pages) {
+        if (pack_in_atlas_page(page, w, h, out_x, out_y)) return page;
+    }
+
+    AtlasPage *page = 0;
 
-        Auto ft_glyph = font->ft_face->glyph;
-        Auto ft_bitmap = ft_glyph->bitmap;
-        Auto w = ft_bitmap.width;
-        Auto h = ft_bitmap.rows;
-
-        slot->width = w;
-        slot->height = h;
-        slot->bearing_x = ft_glyph->bitmap_left;
-        slot->bearing_y = ft_glyph->bitmap_top;
-        slot->advance = (I32)(ft_glyph->advance.x >> 6);
-        slot->pixel_mode = ft_bitmap.pixel_mode;
-
-        if ((w > font->atlas_slot_size) || (h > font->atlas_slot_size)) {
-            log_msg_fmt(LOG_ERROR, LOG_HEADER, 0, "Font glyph too big to fit into atlas slot.");
-            goto done;
+    if (cache->atlas_pages.count >= FONT_ATLAS_MAX_PAGES) {
+        array_iter (it, &cache->atlas_pages) {
+            if (it->last_used == cache->atlas_tick) continue;
+            if (!page || it->last_used < page->last_used) page = it;
         }
+    }
 
-        if ((w == 0) || (h == 0)) {
-            goto done;
+    if (page) {
+        if (cache->vertex_flush_fn) cache->vertex_flush_fn();
+        evict_atlas_page(cache, page);
+    } else {
+        add_atlas_page(cache);
+        page = array_get_last(&cache->atlas_pages);
+    }
+
+    Bool packed = pack_in_atlas_page(page, w, h, out_x, out_y);
+    assert_dbg(packed);
+    return page;
+}
+
+// Called on the main thread with the cache mutex held.
+static Void place_rasterized_glyphs (FontCache *cache) {
+    atomic_exchange(&cache->wake_pending, false);
+    os_mutex_scoped_lock(cache->raster_mutex);
+
+    array_iter (raster, &cache->rasterized) {
+        if (raster->error) log_msg_fmt(LOG_ERROR, LOG_HEADER, 0, "%s", raster->error);
+
+        AtlasSlot *slot = raster->slot;
+        slot->pending = false;
+        slot->bearing_x = raster->bearing_x;
+        slot->bearing_y = raster->bearing_y;
+        slot->pixel_mode = raster->pixel_mode;
+
+        if (raster->pixels) {
+            U32 rect_w = raster->width + 2;
+            U32 rect_h = raster->height + 2;
+            U16 rect_x, rect_y;
+            AtlasPage *page = alloc_atlas_rect(cache, rect_w, rect_h, &rect_x, &rect_y);
+            page->last_used = cache->atlas_tick;
+            array_push(&page->slots, slot);
+
+            slot->page = page;
+            slot->x = rect_x + 1;
+            slot->y = rect_y + 1;
+            slot->width = raster->width;
+            slot->height = raster->height;
+
+            dr_2d_texture_update(&page->texture, rect_x, rect_y, rect_w, rect_h, raster->pixels);
+            mem_free(mem_root, .old_ptr=raster->pixels, .old_size=(rect_w * rect_h * 4));
         }
 
-        U8 *buf = mem_alloc(tm, U8, .zeroed=true, .size=(font->atlas_slot_size * font->atlas_slot_size * 4));
-
-        switch (ft_bitmap.pixel_mode) {
-        case FT_PIXEL_MODE_GRAY: {
-            for (U32 y = 0; y < h; ++y) {
-                U8 *src = ft_bitmap.buffer + y * abs(ft_bitmap.pitch);
-                for (U32 x = 0; x < w; ++x) {
-                    U8 value = src[x];
-                    U32 i = (y * font->atlas_slot_size + x) * 4;
-                    buf[i + 0] = 255;
-                    buf[i + 1] = 255;
-                    buf[i + 2] = 255;
-                    buf[i + 3] = value;
-                }
-            }
-        } break;
-
-        case FT_PIXEL_MODE_BGRA: {
-            for (U32 y = 0; y < h; ++y) {
-                U8 *src = ft_bitmap.buffer + y * abs(ft_bitmap.pitch);
-                for (U32 x = 0; x < w; ++x) {
-                    U32 i = (y * font->atlas_slot_size + x) * 4;
-                    buf[i + 0] = src[x * 4 + 2];
-                    buf[i + 1] = src[x * 4 + 1];
-                    buf[i + 2] = src[x * 4 + 0];
-                    buf[i + 3] = src[x * 4 + 3];
-                }
-            }
-        } break;
+        mem_free(mem_root, .old_ptr=raster, .old_size=sizeof(GlyphRaster));
+    }
 
-        default: badpath;
+    cache->rasters_pending -= cache->rasterized.count;
+    cache->rasterized.count = 0;
+}
+
+// A glyph that isn't in the atlas gets a pending slot, which the
+// glyph is put into by the first font_cache_trim() after one of
+// the workers has rasterized it.
+AtlasSlot *font_get_atlas_slot (Font *font, GlyphInfo *info) {
+    FontCache *cache = font->cache;
+    U64 key = (cast(U64, font->id) << 32) | info->glyph_index;
+    GlyphRaster *raster;
+    AtlasSlot *slot;
+
+    {
+        os_mutex_scoped_lock(cache->mutex);
+        slot = map_get_ptr(&cache->atlas_map, key);
+
+        if (slot) {
+            if (slot->page) slot->page->last_used = cache->atlas_tick;
+            return slot;
         }
 
-        dr_2d_texture_update(&font->atlas_texture, slot->x, slot->y, font->atlas_slot_size, font->atlas_slot_size, buf);
+        slot = cache->free_atlas_slots.count ? array_pop(&cache->free_atlas_slots) : mem_new(mem_root, AtlasSlot);
+        *slot = (AtlasSlot){ .key=key, .pending=true };
+        map_add(&cache->atlas_map, key, slot);
 
-        done:;
+        raster = mem_new(mem_root, GlyphRaster);
+        raster->font = font;
+        raster->slot = slot;
+        raster->glyph_index = info->glyph_index;
+        cache->rasters_pending++;
     }
 
+    // Pushed without holding the lock since this blocks while the
+    // queue of the pool is full.
+    tpool_push(cache->raster_pool, rasterize_glyph, raster);
     return slot;
 }
 
+// For Latin-1 text harfbuzz only does more than look up glyphs
+// and advances where lookups of the features that are on by
+// default apply (ccmp, locl, rlig, rclt, calt, liga, clig, kern,
+// mark, mkmk, ...). Right to left scripts are outside of Latin-1.
+// So the glyphs that those lookups can change are collected, and
+// text made of the other Latin-1 codepoints is laid out from the
+// tables built here. The lookups come from shape plans made the
+// way shape_run() gets them: guessed properties give the Latin
+// script for text with letters, and no script for text with only
+// digits, spaces or punctuation. Advances are scaled the way
+// harfbuzz scales them.
+//
+// C0 and C1 controls aren't default ignorable, so harfbuzz maps
+// them through the cmap like any other codepoint and gives those
+// without a glyph .notdef with its advance. They go in the same
+// way. U+00AD SOFT HYPHEN is the one default ignorable codepoint
+// in Latin-1: harfbuzz hides it and zeroes its advance, so text
+// with it is always shaped.
+static Void init_latin1_fast_path (Font *font) {
+    if (FT_HAS_KERNING(font->ft_face)) return; // An old style kern table, which harfbuzz applies to everything.
+
+    hb_tag_t tables[2] = { HB_OT_TAG_GSUB, HB_OT_TAG_GPOS };
+    hb_script_t scripts[2] = { HB_SCRIPT_LATIN, HB_SCRIPT_INVALID };
+    hb_set_t *lookups = hb_set_create();
+    hb_set_t *changed = hb_set_create();
+
+    for (U32 s = 0; s < 2; ++s) {
+        hb_segment_properties_t props = { .direction=HB_DIRECTION_LTR, .script=scripts[s], .language=hb_language_get_default() };
+        hb_shape_plan_t *plan = hb_shape_plan_create_cached(font->hb_face, &props, 0, 0, 0);
+
+        for (U32 t = 0; t < 2; ++t) {
+            hb_set_clear(lookups);
+            hb_ot_shape_plan_collect_lookups(plan, tables[t], lookups);
+            hb_codepoint_t lookup = HB_SET_VALUE_INVALID;
+            while (hb_set_next(lookups, &lookup)) hb_ot_layout_lookup_collect_glyphs(font->hb_face, tables[t], lookup, 0, changed, 0, 0);
+        }
+
+        hb_shape_plan_destroy(plan);
+    }
+
+    U64 upem  = font->ft_face->units_per_EM;
+    U64 scale = cast(U64, font->size) * 64;
+
+    for (U32 c = 0; c < 256; ++c) {
+        U32 glyph = FT_Get_Char_Index(font->ft_face, c);
+        Bool control = (c < 0x20) || (c >= 0x7f && c < 0xa0);
+        FT_Fixed units = 0;
+
+        if ((c == 0xad) || (!glyph && !control) || hb_set_has(changed, glyph) || FT_Get_Advance(font->ft_face, glyph, FT_LOAD_NO_SCALE, &units)) {
+            font->latin1_glyphs[c] = FONT_NO_FAST_GLYPH;
+        } else {
+            font->latin1_glyphs[c] = glyph;
+            font->latin1_advances[c] = (units * scale + upem/2) / upem;
+        }
+    }
+
+    hb_set_destroy(lookups);
+    hb_set_destroy(changed);
+    font->latin1_fast_path = true;
+}
+
 static Font *font_new (FontCache *cache, String filepath, U32 size, Bool is_mono) {
     Auto font = mem_new(cache->mem, Font);
+    font->id = cache->fonts.count;
     array_push(&cache->fonts, font);
 
     font->is_mono = is_mono;
     font->size = size;
     font->filepath = filepath;
     font->cache = cache;
-    font->lru.lru_next = &font->lru;
-    font->lru.lru_prev = &font->lru;
-    font->atlas_slot_size = 2 * size;
     font->binary = fs_read_entire_file(cache->mem, filepath, 0);
 
-    AtlasSlot *slots = mem_alloc(cache->mem, AtlasSlot, .size=(cache->atlas_size * cache->atlas_size * sizeof(AtlasSlot)));
-    array_init(&font->free_slots, cache->mem);
-    map_init(&font->slot_map, cache->mem);
+    font->ft_face = open_face(cache->ft_lib, font);
 
-    U32 x = 0;
-    U32 y = 0;
-    for (U32 i = 0; i < cast(U32, cache->atlas_size) * cache->atlas_size; ++i) {
-        AtlasSlot *slot = &slots[i];
-        slot->x = x * font->atlas_slot_size;
-        slot->y = y * font->atlas_slot_size;
-        array_push(&font->free_slots, slot);
-        x++;
-        if (x == cache->atlas_size) { x = 0; y++; }
-    }
-
-    FT_Open_Args args = { .flags=FT_OPEN_MEMORY, .memory_base=cast(U8*, font->binary.data), .memory_size=font->binary.count };
-    FT_Open_Face(cache->ft_lib, &args, 0, &font->ft_face);
-    FT_Set_Pixel_Sizes(font->ft_face, 0, size);
-
-    font->hb_face = hb_ft_face_create_referenced(font->ft_face);
+    // Harfbuzz reads the font tables itself rather than asking
+    // FreeType for advances and extents, which is a lot faster and
+    // doesn't touch the FT_Face, so shaping needs no lock.
+    hb_blob_t *blob = hb_blob_create(font->binary.data, font->binary.count, HB_MEMORY_MODE_READONLY, 0, 0);
+    font->hb_face = hb_face_create(blob, 0);
     font->hb_font = hb_font_create(font->hb_face);
+    hb_ot_font_set_funcs(font->hb_font);
+    hb_blob_destroy(blob);
     I32 hb_font_size = size * 64;
     hb_font_set_scale(font->hb_font, hb_font_size, hb_font_size);
-
-    font->atlas_texture = dr_2d_texture_alloc(cache->atlas_size*font->atlas_slot_size, cache->atlas_size*font->atlas_slot_size);
+    init_latin1_fast_path(font);
 
     { // Get metrics:
         U32 glyph_index = FT_Get_Char_Index(font->ft_face, 'M');
-        AtlasSlot *slot = font_get_atlas_slot(font, &(GlyphInfo){.glyph_index = glyph_index});
+        FT_Load_Glyph(font->ft_face, glyph_index, FT_HAS_COLOR(font->ft_face) ? FT_LOAD_COLOR : FT_LOAD_DEFAULT);
         font->ascent    = font->ft_face->size->metrics.ascender >> 6;
         font->descent   = -(font->ft_face->size->metrics.descender >> 6);
         font->height    = font->ft_face->size->metrics.height >> 6;
-        font->width     = slot->advance;
+        font->width     = font->ft_face->glyph->advance.x >> 6;
     }
 
     return font;
 }
 
 Font *font_get (FontCache *cache, String filepath, U32 size, Bool is_mono) {
+    os_mutex_scoped_lock(cache->mutex);
     Font *font = 0;
 
     array_iter (it, &cache->fonts) {
@@ -181,34 +404,122 @@ Font *font_get (FontCache *cache, String filepath, U32 size, Bool is_mono) {
     return font ? font : font_new(cache, filepath, size, is_mono);
 }
 
-FontCache *font_cache_new (Mem *mem, VertexFlushFn vertex_flush_fn, U16 atlas_size) {
+FontCache *font_cache_new (Mem *mem, VertexFlushFn vertex_flush_fn) {
     Auto cache = mem_new(mem, FontCache);
     cache->mem = mem;
     cache->vertex_flush_fn = vertex_flush_fn;
-    cache->atlas_size = atlas_size;
+    cache->mutex = os_mutex_new(mem);
+    cache->run_budget = FONT_RUN_CACHE_BUDGET;
+    cache->run_lru.lru_next = &cache->run_lru;
+    cache->run_lru.lru_prev = &cache->run_lru;
     array_init(&cache->fonts, mem);
+    array_init(&cache->atlas_pages, mem);
+    array_init(&cache->free_atlas_slots, mem_root);
+    array_init(&cache->rasterized, mem_root);
+    map_init(&cache->atlas_map, mem_root);
+    map_init(&cache->run_map, mem_root);
+    cache->ft_lib = new_ft_library();
+    cache->raster_mutex = os_mutex_new(mem);
+    cache->raster_workers = mem_alloc(mem, RasterWorker, .zeroed=true, .size=(FONT_RASTER_THREADS * sizeof(RasterWorker)));
+    cache->raster_pool = tpool_new(mem, FONT_RASTER_THREADS, FONT_RASTER_QUEUE);
+    return cache;
+}
 
-    FT_Init_FreeType(&cache->ft_lib);
+static Void run_lru_unlink (ShapedRun *run) {
+    run->lru_next->lru_prev = run->lru_prev;
+    run->lru_prev->lru_next = run->lru_next;
+}
 
-    Auto hooks = plutosvg_ft_svg_hooks();
-    FT_Property_Set(cache->ft_lib, "ot-svg", "svg-hooks", hooks);
+static Void run_lru_push_front (FontCache *cache, ShapedRun *run) {
+    run->lru_next = cache->run_lru.lru_next;
+    run->lru_prev = &cache->run_lru;
+    cache->run_lru.lru_next->lru_prev = run;
+    cache->run_lru.lru_next = run;
+}
 
-    return cache;
+// One buffer per thread is reused for all shaping, since its
+// allocations can be kept between calls.
+static tls hb_buffer_t *shape_buffer;
+
+static hb_buffer_t *shape (Font *font, String text) {
+    if (! shape_buffer) shape_buffer = hb_buffer_create();
+    hb_buffer_clear_contents(shape_buffer);
+    hb_buffer_add_utf8(shape_buffer, text.data, text.count, 0, text.count);
+    hb_buffer_guess_segment_properties(shape_buffer);
+    hb_shape(font->hb_font, shape_buffer, 0, 0);
+    return shape_buffer;
 }
 
-SliceGlyphInfo font_get_glyph_infos (Font *font, Mem *mem, String text) {
-    ArrayGlyphInfo infos;
-    array_init(&infos, mem);
+// Returns the number of glyphs if the text can be laid out with
+// the Latin-1 tables of the font, or -1 if it must be shaped.
+// Only 1 and 2 byte UTF-8 sequences encode Latin-1 codepoints.
+static I64 count_latin1_glyphs (Font *font, String text) {
+    if (! font->latin1_fast_path) return -1;
+    I64 count = 0;
+
+    for (U64 i = 0; i < text.count; ++i, ++count) {
+        U8 byte = text.data[i];
+        U32 codepoint = byte;
+
+        if (byte >= 0x80) {
+            if ((byte != 0xc2 && byte != 0xc3) || i + 1 == text.count) return -1;
+            U8 next = text.data[++i];
+            if ((next & 0xc0) != 0x80) return -1;
+            codepoint = ((byte & 0x1f) << 6) | (next & 0x3f);
+        }
 
-    I32 cursor_x = 0;
+        if (font->latin1_glyphs[codepoint] == FONT_NO_FAST_GLYPH) return -1;
+    }
+
+    return count;
+}
+
+// The run, its glyphs and a copy of the text are one allocation.
+static ShapedRun *run_new (Font *font, String text, U64 hash, U32 glyph_count) {
+    U64 bytes = sizeof(ShapedRun) + glyph_count*sizeof(GlyphInfo) + text.count;
+    ShapedRun *run = mem_alloc(mem_root, ShapedRun, .size=bytes);
+    run->font = font;
+    run->hash = hash;
+    run->bytes = bytes;
+    run->glyphs = (SliceGlyphInfo){ .data=cast(GlyphInfo*, run + 1), .count=glyph_count };
+    run->text = (String){ .data=cast(Char*, run->glyphs.data + glyph_count), .count=text.count };
+    memcpy(run->text.data, text.data, text.count);
+    return run;
+}
+
+// Glyph positions are rounded from the unrounded pen position so
+// that the rounding errors of the advances don't add up.
+static ShapedRun *shape_run (Font *font, String text, U64 hash) {
+    I32 cursor_x = 0; // In 26.6 fixed point.
     I32 cursor_y = 0;
 
-    Auto buffer = hb_buffer_create();
+    I64 latin1_count = count_latin1_glyphs(font, text);
+
+    if (latin1_count >= 0) {
+        ShapedRun *run = run_new(font, text, hash, latin1_count);
+        U32 byte_offset = 0;
+
+        array_iter (glyph, &run->glyphs, *) {
+            U8 byte = text.data[byte_offset];
+            U32 codepoint = (byte < 0x80) ? byte : (((byte & 0x1f) << 6) | (text.data[byte_offset + 1] & 0x3f));
+            I32 advance = font->latin1_advances[codepoint];
 
-    hb_buffer_add_utf8(buffer, text.data, text.count, 0, text.count);
-    hb_buffer_guess_segment_properties(buffer);
+            *glyph = (GlyphInfo){
+                .x = (cursor_x + 32) >> 6,
+                .x_advance = ((cursor_x + advance + 32) >> 6) - ((cursor_x + 32) >> 6),
+                .glyph_index = font->latin1_glyphs[codepoint],
+                .codepoint = codepoint,
+                .byte_offset = byte_offset,
+            };
 
-    hb_shape(font->hb_font, buffer, 0, 0);
+            cursor_x += advance;
+            byte_offset += (byte < 0x80) ? 1 : 2;
+        }
+
+        return run;
+    }
+
+    Auto buffer = shape(font, text);
 
     Slice(hb_glyph_info_t) hb_infos;
     Slice(hb_glyph_position_t) hb_positions;
@@ -221,25 +532,169 @@ SliceGlyphInfo font_get_glyph_infos (Font *font, Mem *mem, String text) {
     hb_positions.data = hb_buffer_get_glyph_positions(buffer, &position_count);
     hb_positions.count = position_count;
 
+    ShapedRun *run = run_new(font, text, hash, info_count);
+
     array_iter (info, &hb_infos) {
         Auto pos = array_get(&hb_positions, ARRAY_IDX);
         UtfDecode codepoint = str_utf8_decode(str_suffix_from(text, info.cluster));
 
-        array_push_lit(&infos,
-            .x = cursor_x + (pos.x_offset >> 6),
-            .y = cursor_y + (pos.y_offset >> 6),
-            .x_advance = pos.x_advance >> 6,
-            .y_advance = pos.y_advance >> 6,
+        array_set(&run->glyphs, ARRAY_IDX, ((GlyphInfo){
+            .x = (cursor_x + pos.x_offset + 32) >> 6,
+            .y = (cursor_y + pos.y_offset + 32) >> 6,
+            .x_advance = ((cursor_x + pos.x_advance + 32) >> 6) - ((cursor_x + 32) >> 6),
+            .y_advance = ((cursor_y + pos.y_advance + 32) >> 6) - ((cursor_y + 32) >> 6),
             .glyph_index = info.codepoint, // After shaping harfbuzz sets this field to the glyph index.
             .codepoint = codepoint.codepoint,
             .byte_offset = info.cluster,
-        );
+        }));
 
-        cursor_x += pos.x_advance >> 6;
-        cursor_y += pos.y_advance >> 6;
+        cursor_x += pos.x_advance;
+        cursor_y += pos.y_advance;
     }
 
-    hb_buffer_destroy(buffer);
+    return run;
+}
+
+SliceGlyphInfo font_get_shaped_run (Font *font, String text) {
+    FontCache *cache = font->cache;
+    U64 hash = str_hash_seed(text, cast(U64, font));
 
+    {
+        os_mutex_scoped_lock(cache->mutex);
+        ShapedRun *run = map_get_ptr(&cache->run_map, hash);
+
+        if (run && run->font == font && str_match(run->text, text)) {
+            cache->run_stats.hits++;
+            run_lru_unlink(run);
+            run_lru_push_front(cache, run);
+            return run->glyphs;
+        }
+    }
+
+    // Shaping happens outside of the lock, so another thread may
+    // have put the same run into the map in the meantime. Both are
+    // kept until they get trimmed. The same goes for hash collisions.
+    ShapedRun *run = shape_run(font, text, hash);
+
+    os_mutex_scoped_lock(cache->mutex);
+    if (! map_get_ptr(&cache->run_map, hash)) map_add(&cache->run_map, hash, run);
+    cache->run_stats.misses++;
+    cache->run_stats.runs++;
+    cache->run_stats.bytes += run->bytes;
+    run_lru_push_front(cache, run);
+    return run->glyphs;
+}
+
+SliceGlyphInfo font_get_glyph_infos (Font *font, Mem *mem, String text) {
+    ArrayGlyphInfo infos;
+    array_init(&infos, mem);
+    SliceGlyphInfo shaped = font_get_shaped_run(font, text);
+    array_push_many(&infos, &shaped);
     return infos.as_slice;
 }
+
+Void font_cache_trim (FontCache *cache) {
+    os_mutex_scoped_lock(cache->mutex);
+
+    while (cache->run_stats.bytes > cache->run_budget) {
+        ShapedRun *run = cache->run_lru.lru_prev;
+        run_lru_unlink(run);
+        if (map_get_ptr(&cache->run_map, run->hash) == run) map_remove(&cache->run_map, run->hash);
+        cache->run_stats.bytes -= run->bytes;
+        cache->run_stats.runs--;
+        cache->run_stats.evictions++;
+        mem_free(mem_root, .old_ptr=run, .old_size=run->bytes);
+    }
+
+    place_rasterized_glyphs(cache);
+    cache->atlas_tick++;
+}
+
+AtlasStats font_get_atlas_stats (FontCache *cache) {
+    os_mutex_scoped_lock(cache->mutex);
+
+    AtlasStats stats = {
+        .pages           = cache->atlas_pages.count,
+        .pending         = cache->rasters_pending,
+        .total_area      = cache->atlas_pages.count * FONT_ATLAS_PAGE_SIZE * FONT_ATLAS_PAGE_SIZE,
+        .page_evictions  = cache->atlas_page_evictions,
+        .glyph_evictions = cache->atlas_glyph_evictions,
+    };
+
+    array_iter (page, &cache->atlas_pages) {
+        stats.glyphs += page->slots.count;
+        stats.used_area += page->used_area;
+        array_iter (shelf, &page->shelves, *) stats.shelf_area += shelf->height * FONT_ATLAS_PAGE_SIZE;
+    }
+
+    stats.occupancy = stats.total_area ? cast(F32, stats.used_area) / stats.total_area : 0;
+    return stats;
+}
+
+// Shapes each line of the text the way it was done before, with
+// a new buffer per line and FreeType font funcs, then with the
+// reused buffer and OpenType funcs, and then lays out the lines
+// that qualify with the Latin-1 fast path. The run cache is not
+// used. Logs the glyphs per second of each.
+Void font_benchmark_shaping (Font *font, String text) {
+    tmem_new(tm);
+
+    ArrayString lines;
+    array_init(&lines, tm);
+    str_split(text, str("\n"), false, false, &lines);
+
+    hb_font_t *ft_font = hb_ft_font_create_referenced(font->ft_face);
+    U64 ft_glyphs = 0;
+    U64 ot_glyphs = 0;
+
+    U64 start = os_get_time_ms();
+    array_iter (line, &lines) {
+        Auto buffer = hb_buffer_create();
+        hb_buffer_add_utf8(buffer, line.data, line.count, 0, line.count);
+        hb_buffer_guess_segment_properties(buffer);
+        hb_shape(ft_font, buffer, 0, 0);
+        ft_glyphs += hb_buffer_get_length(buffer);
+        hb_buffer_destroy(buffer);
+    }
+    F64 ft_secs = max(1ul, os_get_time_ms() - start) / 1000.0;
+
+    start = os_get_time_ms();
+    array_iter (line, &lines) ot_glyphs += hb_buffer_get_length(shape(font, line));
+    F64 ot_secs = max(1ul, os_get_time_ms() - start) / 1000.0;
+
+    U64 fast_lines  = 0;
+    U64 fast_glyphs = 0;
+
+    start = os_get_time_ms();
+    array_iter (line, &lines) {
+        if (count_latin1_glyphs(font, line) < 0) continue;
+        ShapedRun *run = shape_run(font, line, 0);
+        fast_glyphs += run->glyphs.count;
+        fast_lines++;
+        mem_free(mem_root, .old_ptr=run, .old_size=run->bytes);
+    }
+    F64 fast_secs = max(1ul, os_get_time_ms() - start) / 1000.0;
+
+    hb_font_destroy(ft_font);
+
+    log_msg_fmt(LOG_NOTE, LOG_HEADER, 1, "Shaped %" PRIu64 " lines (%" PRIu64 " bytes) with %.*s.", lines.count, text.count, STR(font->filepath));
+    log_msg_fmt(LOG_NOTE, LOG_HEADER, 1, "FreeType funcs, new buffers:   %.0f glyphs/s (%" PRIu64 " glyphs in %.3fs)", ft_glyphs / ft_secs, ft_glyphs, ft_secs);
+    log_msg_fmt(LOG_NOTE, LOG_HEADER, 1, "OpenType funcs, reused buffer: %.0f glyphs/s (%" PRIu64 " glyphs in %.3fs)", ot_glyphs / ot_secs, ot_glyphs, ot_secs);
+    log_msg_fmt(LOG_NOTE, LOG_HEADER, 1, "Latin-1 fast path:             %.0f glyphs/s (%" PRIu64 " glyphs in %.3fs, %" PRIu64 " of the lines)", fast_glyphs / fast_secs, fast_glyphs, fast_secs, fast_lines);
+}
+
+// The pen is where the glyph's origin goes in window coordinates.
+// This binds the atlas page that the glyph is on.
+Void font_draw_glyph (AtlasSlot *slot, Vec2 pen, Vec4 color) {
+    if (! slot->page) return;
+    dr_bind_texture(&slot->page->texture);
+    Vec2 top_left = { pen.x + slot->bearing_x, pen.y - slot->bearing_y };
+    dr_glyph(top_left, slot->x, slot->y, slot->width, slot->height, color, slot->pixel_mode == FT_PIXEL_MODE_GRAY);
+}
+
+Void dr_glyph_run (Font *font, SliceGlyphInfo glyphs, Vec2 origin, Vec4 color) {
+    array_iter (glyph, &glyphs, *) {
+        AtlasSlot *slot = font_get_atlas_slot(font, glyph);
+        font_draw_glyph(slot, (Vec2){ origin.x + glyph->x, origin.y + glyph->y }, color);
+    }
+}
@@ -4,6 +4,8 @@
 #include <hb-ft.h>
 #include "base/core.h"
 #include "base/map.h"
+#include "base/tpool.h"
+#include "os/threads.h"
 #include "window/window.h"
 
 istruct (GlyphInfo) {
@@ -16,24 +18,77 @@ istruct (GlyphInfo) {
     U32 byte_offset;
 };
 
+// Glyphs of every font and size are packed into the same atlas
+// pages. A page is cut into shelves that span its width and are
+// filled left to right, each holding glyphs of about its height.
+// A glyph keeps a 1 texel transparent border within its rect so
+// that filtering never picks up a neighbour.
+//
+// Glyphs are rasterized on a thread pool, with a FreeType library
+// and faces per worker since those can't be used by two threads
+// at once. Until then a glyph has a pending slot which draws
+// nothing. Slots have no advance since layout must use the one
+// in GlyphInfo, which doesn't change when the glyph lands. The
+// workers call win_wake() when done, and font_cache_trim() moves
+// their glyphs into the atlas at the start of the next frame. If no
+// page has room a new one is added, up to the max, and after
+// that the least recently used page is emptied. A page used in
+// the last frame is never emptied; the atlas grows past the max
+// instead.
+#define FONT_ATLAS_PAGE_SIZE 1024
+#define FONT_ATLAS_MAX_PAGES 8
+#define FONT_RASTER_THREADS  2
+#define FONT_RASTER_QUEUE    1024
+
+istruct (AtlasPage);
+
 istruct (AtlasSlot) {
-    U16 x;
+    AtlasPage *page; // Null if the glyph has no pixels or is pending.
+    U16 x; // Of the glyph in the page, which excludes the border.
     U16 y;
     U32 width;
     U32 height;
     I32 bearing_x;
     I32 bearing_y;
-    I32 advance;
     FT_Pixel_Mode pixel_mode;
-    U32 glyph_index;
-    AtlasSlot *lru_next;
-    AtlasSlot *lru_prev;
+    U64 key; // Font id and glyph index.
+    Bool pending; // Still being rasterized.
+};
+
+istruct (AtlasShelf) {
+    U16 y;
+    U16 height;
+    U16 used_width;
+};
+
+istruct (AtlasPage) {
+    Texture texture;
+    Array(AtlasShelf) shelves;
+    Array(AtlasSlot*) slots;
+    U32 used_height; // Where the next shelf starts.
+    U64 used_area; // Texels of the glyph rects.
+    U64 last_used; // Value of FontCache.atlas_tick when a slot in it was last used.
+};
+
+istruct (AtlasStats) {
+    U64 pages;
+    U64 glyphs;
+    U64 pending; // Glyphs being rasterized.
+    U64 used_area; // Texels of the glyph rects.
+    U64 shelf_area; // Texels of the shelves, which includes the gaps after glyphs.
+    U64 total_area;
+    F32 occupancy; // used_area / total_area
+    U64 page_evictions; // Totals since startup.
+    U64 glyph_evictions;
 };
 
 istruct (FontCache);
 
+#define FONT_NO_FAST_GLYPH UINT32_MAX
+
 istruct (Font) {
     FontCache *cache;
+    U32 id; // Index in FontCache.fonts.
 
     String filepath;
     String binary;
@@ -41,34 +96,102 @@ istruct (Font) {
     hb_face_t *hb_face;
     hb_font_t *hb_font;
 
+    // Glyph indices and advances (in 26.6) of the Latin-1 codepoints
+    // for laying out text that doesn't need shaping. Only set up if
+    // latin1_fast_path is true. See init_latin1_fast_path().
+    Bool latin1_fast_path;
+    U32 latin1_glyphs[256]; // FONT_NO_FAST_GLYPH if the text must be shaped.
+    I32 latin1_advances[256];
+
     Bool is_mono;
     U32 size; // As given to font_get().
     U32 height;
     U32 width;
     U32 ascent;
     U32 descent;
+};
+
+typedef Void (*VertexFlushFn)();
+
+array_typedef(GlyphInfo, GlyphInfo);
 
-    AtlasSlot lru;
-    Array(AtlasSlot*) free_slots;
-    Map(U32, AtlasSlot*) slot_map;
+// Results of shaping are kept in an LRU cache keyed by the font
+// and the text. See font_get_shaped_run().
+#define FONT_RUN_CACHE_BUDGET (4*MB) // Default for FontCache.run_budget.
 
-    Texture atlas_texture;
-    U16 atlas_slot_size;
+istruct (ShapedRun) {
+    Font *font;
+    U64 hash;
+    String text;
+    SliceGlyphInfo glyphs;
+    U64 bytes; // Of the single allocation holding all of this.
+    ShapedRun *lru_next;
+    ShapedRun *lru_prev;
 };
 
-typedef Void (*VertexFlushFn)();
+istruct (ShapedRunStats) {
+    U64 hits;
+    U64 misses;
+    U64 evictions;
+    U64 runs;
+    U64 bytes;
+};
+
+istruct (GlyphRaster);
+istruct (RasterWorker);
 
+// The font_* functions can be called from several threads at the
+// same time, except for font_cache_trim() which must be called on
+// the main thread since it allocates and updates atlas pages. The
+// slots returned by font_get_atlas_slot() stay valid until then.
 istruct (FontCache) {
     Mem *mem;
+    OsMutex *mutex;
     Array(Font*) fonts;
     FT_Library ft_lib;
     VertexFlushFn vertex_flush_fn;
-    U16 atlas_size;
-};
 
-array_typedef(GlyphInfo, GlyphInfo);
+    Array(AtlasPage*) atlas_pages;
+    Map(U64, AtlasSlot*) atlas_map;
+    Array(AtlasSlot*) free_atlas_slots;
+    U64 atlas_tick; // Advanced by every font_cache_trim(), so once per frame.
+    U64 atlas_page_evictions;
+    U64 atlas_glyph_evictions;
+
+    TPool *raster_pool;
+    RasterWorker *raster_workers; // Indexed by the worker id of the pool.
+    OsMutex *raster_mutex;
+    Array(GlyphRaster*) rasterized; // Guarded by raster_mutex.
+    U64 rasters_pending;
+    Bool wake_pending; // Atomic. Set by the worker that called win_wake().
+
+    U64 run_budget; // In bytes.
+    ShapedRun run_lru;
+    Map(U64, ShapedRun*) run_map;
+    ShapedRunStats run_stats; // Hits, misses and evictions are totals since startup.
+};
 
-FontCache     *font_cache_new       (Mem *, VertexFlushFn, U16 atlas_size);
+FontCache     *font_cache_new       (Mem *, VertexFlushFn);
+Void           font_cache_trim      (FontCache *);
 Font          *font_get             (FontCache *, String filepath, U32 size, Bool is_mono);
 AtlasSlot     *font_get_atlas_slot  (Font *, GlyphInfo *);
-SliceGlyphInfo font_get_glyph_infos (Font *, Mem *, String);
+AtlasStats     font_get_atlas_stats (FontCache *);
+SliceGlyphInfo font_get_glyph_infos (Font *, Mem *, String); // A copy of font_get_shaped_run().
+Void           font_draw_glyph      (AtlasSlot *, Vec2 pen, Vec4 color);
+
+// The glyphs are shared with every other caller that shapes the
+// same text with the same font, so they must not be modified.
+// They stay valid until the next call to font_cache_trim(), which
+// evicts the least recently used runs until the cache is within
+// FontCache.run_budget. The ui calls it at the start of a frame,
+// so the results can be used until the end of it. Use
+// font_get_glyph_infos() to keep glyphs for longer.
+SliceGlyphInfo font_get_shaped_run  (Font *, String);
+
+Void font_benchmark_shaping (Font *, String text); // Run with -bench-shaping <file>.
+
+// Draws the glyphs at their shaped positions with the glyph
+// pipeline. The origin is the pen position of the first glyph.
+// This lives here rather than in the window module because the
+// window module doesn't know about fonts.
+Void dr_glyph_run (Font *, SliceGlyphInfo, Vec2 origin, Vec4 color);
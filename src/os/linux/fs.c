@@ -132,7 +132,7 @@ String fs_get_full_path (Mem *mem, String path) {
     return r ? str(b) : (String){};
 }
 
-Bool fs_delete_file (String path) {
+Bool fs_delete (String path) {
     tmem_new(tm);
     Int r = remove(cstr(tm, path));
     return r == 0;
@@ -6,10 +6,18 @@
 #include "base/map.h"
 #include "buffer/buffer.h"
 #include "os/fs.h"
+#include "os/info.h"
 #include "window/window.h"
 #include "ui/ui.h"
 
-Ui *ui;
+// Thread local since the draw tasks run with their own copy of
+// it. See draw_tree().
+tls Ui *ui;
+
+// Set on the threads of the draw pool. The copy of the Ui that a
+// draw task gets shares the maps of the real one, so the functions
+// that change them assert that this is false.
+tls Bool is_draw_worker;
 
 Noreturn static Void error () {
     log_scope_end_all();
@@ -38,6 +46,7 @@ static Void free_box_data (UiBox *box) {
     Void *data = map_get_ptr(&ui->box_data, box->key);
 
     if (data) {
+        assert_always(! is_draw_worker);
         Mem **mem = data;
         arena_destroy(cast(Arena*, *mem));
         map_remove(&ui->box_data, box->key);
@@ -48,6 +57,7 @@ Void *ui_get_box_data (UiBox *box, U64 size, U64 arena_block_size) {
     Void *data = map_get_ptr(&ui->box_data, box->key);
 
     if (! data) {
+        assert_always(! is_draw_worker);
         assert_always(size);
         assert_always(arena_block_size);
         Arena *arena = arena_new(mem_root, arena_block_size);
@@ -77,6 +87,28 @@ static Rect compute_rect_intersect (Rect r0, Rect r1) {
     return (Rect){ x0, y0, max(0, x1 - x0), max(0, y1 - y0) };
 }
 
+static Bool rect_is_empty (Rect r) {
+    return (r.w <= 0) || (r.h <= 0);
+}
+
+static Rect compute_rect_union (Rect r0, Rect r1) {
+    if (rect_is_empty(r0)) return r1;
+    if (rect_is_empty(r1)) return r0;
+    F32 x0 = min(r0.x, r1.x);
+    F32 y0 = min(r0.y, r1.y);
+    F32 x1 = max(r0.x + r0.w, r1.x + r1.w);
+    F32 y1 = max(r0.y + r0.h, r1.y + r1.h);
+    return (Rect){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+static Bool rect_match (Rect r0, Rect r1) {
+    return (r0.x == r1.x) && (r0.y == r1.y) && (r0.w == r1.w) && (r0.h == r1.h);
+}
+
+static Void add_damage (Rect r) {
+    ui->damage = compute_rect_union(ui->damage, r);
+}
+
 static Void compute_signals (UiBox *box) {
     UiSignals *sig = &box->signals;
     Bool pressed = sig->pressed;
@@ -122,6 +154,7 @@ UiBox *ui_pop_parent () {
 }
 
 UiBox *ui_box_push_str (UiBoxFlags flags, String label) {
+    assert_always(! is_draw_worker);
     UiKey key  = ui_build_key(label);
     UiBox *box = map_get_ptr(&ui->box_cache, key);
 
@@ -148,6 +181,8 @@ UiBox *ui_box_push_str (UiBoxFlags flags, String label) {
         box->scratch = 0;
         box->draw_fn = 0;
         box->size_fn = 0;
+        box->drawn_bounds = (Rect){};
+        box->drawn_hash = 0;
         map_add(&ui->box_cache, key, box);
     } else {
         box = mem_new(ui->perm_mem, UiBox);
@@ -604,7 +639,6 @@ Bool ui_set_font (UiBox *box) {
     U32 size = box->style.font_size;
     if (!font || !size) return false;
     if (ui->font != font || size != ui->font->size) {
-        dr_flush_vertices();
         ui->font = font_get(ui->font_cache, font->filepath, size, font->is_mono);
     }
     return true;
@@ -860,10 +894,137 @@ static Void find_topmost_hovered_box (UiBox *box) {
     if (box->flags & UI_BOX_CLIPPING) ui_pop_clip();
 }
 
-static Void draw_box (UiBox *box) {
-    F32 win_height = win_get_size().y;
+// The box is damaged if what it draws itself (not counting the
+// children) changed since last frame. In that case both the old
+// and new area it covers need to be redrawn.
+static Void update_box_damage (UiBox *box, Rect clip, U64 sibling_idx, U64 hash, Rect bounds) {
+    bounds = compute_rect_intersect(bounds, clip);
 
     if (!(box->flags & UI_BOX_INVISIBLE) && box->style.blur_radius) {
+        // The blur isn't clipped.
+        bounds = compute_rect_union(bounds, box->rect);
+        F32 margin = dr_blur_margin(max(1, cast(Int, box->style.blur_radius)));
+        array_push_lit(&ui->blur_regions, box->rect.x - margin, box->rect.y - margin, box->rect.w + 2*margin, box->rect.h + 2*margin);
+    }
+
+    // The sibling index is hashed so that reordering overlapping
+    // boxes counts as a change.
+    hash = str_hash_seed((String){ .data=cast(Char*, &clip), .count=sizeof(clip) }, hash);
+    hash = str_hash_seed((String){ .data=cast(Char*, &sibling_idx), .count=sizeof(sibling_idx) }, hash);
+
+    if (hash != box->drawn_hash || !rect_match(bounds, box->drawn_bounds)) {
+        add_damage(box->drawn_bounds);
+        add_damage(bounds);
+    }
+
+    box->drawn_hash = hash;
+    box->drawn_bounds = bounds;
+}
+
+// A blurred box shows what was drawn under it, so it's damaged
+// if anything within reach of the blur is. The blur also reads
+// from the framebuffer, and outside the damaged area it holds
+// the final image of the last frame, so the whole area that the
+// blur reads has to be redrawn as well.
+static Void flush_damage () {
+    Vec2 win = win_get_size();
+
+    if (ui->damage_everything) {
+        ui->damage = (Rect){ 0, 0, win.x, win.y };
+    } else {
+        Bool changed = true;
+
+        while (changed) {
+            changed = false;
+
+            array_iter (region, &ui->blur_regions) {
+                if (rect_is_empty(compute_rect_intersect(region, ui->damage))) continue;
+                Rect damage = compute_rect_union(ui->damage, region);
+                if (rect_match(damage, ui->damage)) continue;
+                ui->damage = damage;
+                changed = true;
+            }
+        }
+    }
+
+    dr_set_damage(ui->damage);
+    ui->damage = (Rect){};
+    ui->damage_everything = false;
+    ui->blur_regions.count = 0;
+}
+
+// Called by the font cache before it overwrites an atlas slot.
+// Rects that sampled the old glyph might be retained in parts
+// of the framebuffer we don't redraw, so we redraw everything.
+static Void flush_on_glyph_eviction () {
+    dr_flush_vertices();
+    ui->damage_everything = true;
+}
+
+static Bool spawn_draw_task (UiBox *, U64);
+
+// Whether the area a box can paint into with its background
+// intersects the clip. The rect is grown the same way dr_rect()
+// grows it to make room for the outset shadow.
+static Bool box_is_visible (UiBox *box, Rect clip) {
+    if (!(box->flags & UI_BOX_INVISIBLE) && box->style.blur_radius) return true; // The blur isn't clipped.
+
+    F32 grow = 2*box->style.outset_shadow_width + 2*box->style.edge_softness;
+    Vec2 offsets = box->style.shadow_offsets;
+    Rect r = box->rect;
+    r.x -= grow + fabsf(offsets.x);
+    r.y -= grow + fabsf(offsets.y);
+    r.w += 2*(grow + fabsf(offsets.x));
+    r.h += 2*(grow + fabsf(offsets.y));
+
+    return !rect_is_empty(compute_rect_intersect(r, clip));
+}
+
+// Everything a clipping box and its descendants draw is scissored
+// to the clip of the box, so if that box lies outside of the active
+// clip the whole subtree can be skipped. The area the subtree drew
+// last frame is still damaged so that it gets erased.
+//
+// Boxes with a custom size function may measure themselves in the
+// draw function (labels do), so that one still runs with an empty
+// clip on the stack. Such draw functions have to skip drawing when
+// the clip is empty.
+static Void cull_box (UiBox *box) {
+    ui->boxes_culled++;
+    add_damage(box->drawn_bounds);
+    box->drawn_bounds = (Rect){};
+    box->drawn_hash = 0;
+
+    array_push(&ui->box_stack, box);
+    if (box->draw_fn && box->size_fn) box->draw_fn(box);
+    array_iter (c, &box->children) cull_box(c);
+    array_pop(&ui->box_stack);
+}
+
+static Void cull_subtree (UiBox *box) {
+    array_push(&ui->clip_stack, (Rect){});
+    cull_box(box);
+    array_pop(&ui->clip_stack);
+}
+
+static Bool should_cull_subtree (UiBox *box) {
+    return (box->flags & UI_BOX_CLIPPING) && !box_is_visible(box, array_get_last(&ui->clip_stack));
+}
+
+static Void draw_box (UiBox *box, U64 sibling_idx) {
+    F32 win_height = win_get_size().y;
+    Rect clip = array_get_last(&ui->clip_stack);
+
+    dr_label(box->label);
+    dr_hash_begin();
+
+    // The draw function still runs for boxes outside of the clip
+    // since it may draw outside of the box (and labels measure
+    // themselves in it), but the background is skipped.
+    Bool visible = box_is_visible(box, clip);
+    if (! visible) ui->boxes_culled++;
+
+    if (visible && !(box->flags & UI_BOX_INVISIBLE) && box->style.blur_radius) {
         F32 blur_radius = max(1, cast(Int, box->style.blur_radius));
         dr_blur(box->rect, blur_radius, box->style.radius);
         Rect r = array_get_last(&ui->clip_stack);
@@ -871,7 +1032,7 @@ static Void draw_box (UiBox *box) {
 
     }
 
-    if (! (box->flags & UI_BOX_INVISIBLE)) dr_rect(
+    if (visible && !(box->flags & UI_BOX_INVISIBLE)) dr_rect(
         .top_left            = box->rect.top_left,
         .bottom_right        = vec2(box->rect.x + box->rect.w, box->rect.y + box->rect.h),
         .color               = box->style.bg_color,
@@ -895,7 +1056,16 @@ static Void draw_box (UiBox *box) {
 
     array_push(&ui->box_stack, box); // For use_style_var_get().
     if (box->draw_fn) box->draw_fn(box);
-    array_iter (c, &box->children) draw_box(c);
+
+    Rect bounds;
+    U64 hash = dr_hash_end(&bounds);
+    update_box_damage(box, clip, sibling_idx, hash, bounds);
+
+    array_iter (c, &box->children) {
+        if (should_cull_subtree(c)) cull_subtree(c);
+        else if (! spawn_draw_task(c, ARRAY_IDX)) draw_box(c, ARRAY_IDX);
+    }
+
     array_pop(&ui->box_stack);
 
     if (box->flags & UI_BOX_CLIPPING) {
@@ -905,6 +1075,130 @@ static Void draw_box (UiBox *box) {
     }
 }
 
+// =============================================================================
+// Parallel drawing:
+// -----------------
+//
+// The outermost clipping boxes (tile panes, scroll boxes, ...) are
+// drawn on the draw pool while the main thread carries on with the
+// rest of the tree. Each task records into its own DrRecorder and
+// the main thread switches to a new segment recorder after every
+// spawned task, so splicing the recorders in the order they were
+// created gives the same command list as drawing the tree serially.
+// Every clipping box restores the scissor of its parent when it's
+// done, so the scissors line up at the seams.
+//
+// A task draws with a copy of the Ui struct that has its own box
+// and clip stacks, frame memory and damage. The damage gets merged
+// back once all tasks are done. Draw functions may only read the
+// rest of the ui state. Creating boxes or box data from a task
+// trips an assert.
+// =============================================================================
+#define UI_MAX_DRAW_TASKS 64
+
+istruct (UiDrawTask) {
+    Ui ui;
+    Mem *mem; // Freed when the task is reused next frame.
+    UiBox *box;
+    U64 sibling_idx;
+    DrRecorder *recorder;
+};
+
+TPOOL_FN(draw_task) {
+    UiDrawTask *task = arg;
+
+    if (! is_draw_worker) {
+        tmem_setup(mem_root, 1*MB);
+        log_setup(mem_root, 4*KB);
+        is_draw_worker = true;
+    }
+
+    log_scope(ls, 1);
+    ui = &task->ui;
+    dr_record_begin(task->recorder);
+    draw_box(task->box, task->sibling_idx);
+    dr_record_end();
+}
+
+// Creating a font reads the file, opens its FreeType face and
+// builds the Latin-1 tables while holding the font cache lock,
+// which every shaping and atlas lookup takes. So the fonts that
+// the subtree is going to ask for are created before the task is
+// spawned, rather than by a worker that would stall the others.
+static Void create_fonts (UiBox *box) {
+    Font *font = box->style.font;
+    if (font && box->style.font_size) font_get(ui->font_cache, font->filepath, box->style.font_size, font->is_mono);
+    array_iter (child, &box->children) create_fonts(child);
+}
+
+static DrRecorder *next_draw_segment () {
+    if (ui->draw_segment_count == ui->draw_segments.count) array_push(&ui->draw_segments, dr_recorder_new(mem_root));
+    DrRecorder *segment = array_get(&ui->draw_segments, ui->draw_segment_count++);
+    array_push(&ui->draw_order, segment);
+    return segment;
+}
+
+static Bool spawn_draw_task (UiBox *box, U64 sibling_idx) {
+    if (is_draw_worker) return false;
+    if (! (box->flags & UI_BOX_CLIPPING)) return false;
+    if (ui->draw_task_count == UI_MAX_DRAW_TASKS) return false;
+
+    if (ui->draw_task_count == ui->draw_tasks.count) {
+        UiDrawTask *task = mem_new(ui->perm_mem, UiDrawTask);
+        task->mem = cast(Mem*, arena_new(mem_root, 4*KB));
+        task->recorder = dr_recorder_new(mem_root);
+        array_push(&ui->draw_tasks, task);
+    }
+
+    UiDrawTask *task = array_get(&ui->draw_tasks, ui->draw_task_count++);
+    arena_pop_all(cast(Arena*, task->mem));
+    task->box = box;
+    task->sibling_idx = sibling_idx;
+
+    create_fonts(box);
+    if (box->parent) create_fonts(box->parent); // Some draw functions use the font of the parent.
+
+    Ui *t = &task->ui;
+    *t = *ui;
+    t->frame_mem = task->mem;
+    t->damage = (Rect){};
+    t->damage_everything = false;
+    t->boxes_culled = 0;
+    array_init(&t->box_stack, task->mem);
+    array_init(&t->clip_stack, task->mem);
+    array_init(&t->blur_regions, task->mem);
+    array_push_many(&t->box_stack, &ui->box_stack);
+    array_push_many(&t->clip_stack, &ui->clip_stack);
+
+    dr_record_end();
+    array_push(&ui->draw_order, task->recorder);
+    dr_record_begin(next_draw_segment());
+    tpool_push(ui->draw_pool, draw_task, task);
+    return true;
+}
+
+static Void draw_tree () {
+    ui->draw_task_count = 0;
+    ui->draw_segment_count = 0;
+    ui->draw_order.count = 0;
+    ui->boxes_culled = 0;
+
+    dr_record_begin(next_draw_segment());
+    draw_box(ui->root, 0);
+    dr_record_end();
+
+    tpool_wait(ui->draw_pool);
+    dr_splice(ui->draw_order.data, ui->draw_order.count);
+
+    for (U64 i = 0; i < ui->draw_task_count; ++i) {
+        Ui *t = &array_get(&ui->draw_tasks, i)->ui;
+        add_damage(t->damage);
+        ui->damage_everything |= t->damage_everything;
+        ui->boxes_culled += t->boxes_culled;
+        array_push_many(&ui->blur_regions, &t->blur_regions);
+    }
+}
+
 Void ui_eat_event () {
     ui->event->tag = EVENT_EATEN;
 }
@@ -984,6 +1278,7 @@ Bool ui_is_animating () {
 
 Void ui_frame (Void(*app_build)(), F64 dt) {
     ui->dt = dt;
+    font_cache_trim(ui->font_cache);
     ui->animation_running = false;
 
     array_iter (event, win_get_events(), *) {
@@ -1066,6 +1361,7 @@ Void ui_frame (Void(*app_build)(), F64 dt) {
         map_iter (slot, &ui->box_cache) {
             Auto box = slot->val;
             if (box->gc_flag != ui->gc_flag) {
+                add_damage(box->drawn_bounds);
                 array_push(&ui->free_boxes, box);
                 free_box_data(box);
                 map_iter_remove(slot, &ui->box_cache);
@@ -1085,7 +1381,8 @@ Void ui_frame (Void(*app_build)(), F64 dt) {
     }
 
     find_topmost_hovered_box(ui->root);
-    draw_box(ui->root);
+    draw_tree();
+    flush_damage();
     ui->frame++;
     arena_pop_all(cast(Arena*, ui->frame_mem));
 }
@@ -1101,12 +1398,17 @@ Void ui_init () {
     array_init(&ui->clip_stack, ui->perm_mem);
     array_init(&ui->depth_first, ui->perm_mem);
     array_init(&ui->deferred_layout_fns, ui->perm_mem);
+    array_init(&ui->blur_regions, ui->perm_mem);
+    array_init(&ui->draw_tasks, ui->perm_mem);
+    array_init(&ui->draw_segments, ui->perm_mem);
+    array_init(&ui->draw_order, ui->perm_mem);
+    ui->draw_pool = tpool_new(ui->perm_mem, max(os_get_proc_count(), 2ul) - 1, UI_MAX_DRAW_TASKS);
     map_init(&ui->box_cache, ui->perm_mem);
     map_init(&ui->pressed_keys, ui->perm_mem);
     map_init(&ui->box_data, ui->perm_mem);
     Vec2 win = win_get_size();
     array_push_lit(&ui->clip_stack, .w=win.x, .h=win.y);
-    ui->font_cache = font_cache_new(ui->perm_mem, dr_flush_vertices, 64);
+    ui->font_cache = font_cache_new(ui->perm_mem, flush_on_glyph_eviction);
 }
 
 // @todo
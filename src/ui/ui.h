@@ -2,6 +2,7 @@
 
 #include "base/core.h"
 #include "base/math.h"
+#include "base/tpool.h"
 #include "font/font.h"
 #include "window/window.h"
 
@@ -329,6 +330,13 @@ istruct (UiBox) {
     // by the user build code for the purpose of scrolling the
     // content. The w/h components are set by the layout code.
     Rect content;
+
+    // What the box itself drew last frame. See draw_box().
+    Rect drawn_bounds;
+    U64 drawn_hash;
+
+    // Hash of what a label's size depends on. See draw_label().
+    U64 measure_hash;
 };
 
 istruct (UiBoxCallback) {
@@ -336,6 +344,8 @@ istruct (UiBoxCallback) {
     UiBox *box;
 };
 
+istruct (UiDrawTask);
+
 istruct (Ui) {
     Mem *perm_mem;
     Mem *frame_mem;
@@ -363,9 +373,19 @@ istruct (Ui) {
     UiStyleRule *current_style_rule;
     FontCache *font_cache;
     Font *font;
+    Rect damage; // Area of the window that changed this frame.
+    Bool damage_everything;
+    U64 boxes_culled; // Boxes outside of the clip this frame. See draw_box().
+    Array(Rect) blur_regions; // Blurred boxes grown by what the blur reads.
+    TPool *draw_pool;
+    Array(UiDrawTask*) draw_tasks; // Reused across frames. See draw_tree().
+    U64 draw_task_count;
+    Array(DrRecorder*) draw_segments;
+    U64 draw_segment_count;
+    Array(DrRecorder*) draw_order;
 };
 
-extern Ui *ui;
+extern tls Ui *ui;
 
 Void      ui_init                  ();
 Void      ui_frame                 (Void(*)(), F64 dt);
@@ -274,13 +274,12 @@ String ui_ted_cursor_get_selection (UiTextEditorInfo *info, Mem *mem, UiTextEdit
 
 static Void draw_line (UiTextEditorInfo *info, UiBox *box, U64 line_idx, UiTextEditorVisualLine *line, Vec4 color, F32 x, F32 y) {
     tmem_new(tm);
-    dr_bind_texture(&ui->font->atlas_texture);
 
     String line_text = buf_get_slice(info->buf, tm, line->offset, line->count);
 
     U64 cell_w = ui->font->width;
     U64 cell_h = ui->font->height;
-    SliceGlyphInfo infos = font_get_glyph_infos(ui->font, tm, line_text);
+    SliceGlyphInfo infos = font_get_shaped_run(ui->font, line_text);
 
     x = floor(x - info->scroll_coord.x);
 
@@ -311,17 +310,8 @@ static Void draw_line (UiTextEditorInfo *info, UiBox *box, U64 line_idx, UiTextE
 
             if (glyph_info->codepoint != '\t') {
                 AtlasSlot *slot = font_get_atlas_slot(ui->font, glyph_info);
-                Vec2 top_left = {x + slot->bearing_x, y - descent - line_spacing/2 - slot->bearing_y};
-                Vec2 bottom_right = {top_left.x + slot->width, top_left.y + slot->height};
                 Vec4 final_text_color = selected ? ui_config_get_vec4(UI_CONFIG_TEXT_SELECTION) : color;
-
-                dr_rect(
-                    .top_left     = top_left,
-                    .bottom_right = bottom_right,
-                    .texture_rect = {slot->x, slot->y, slot->width, slot->height},
-                    .text_color   = final_text_color,
-                    .text_is_grayscale = (slot->pixel_mode == FT_PIXEL_MODE_GRAY),
-                );
+                font_draw_glyph(slot, (Vec2){x, y - descent - line_spacing/2}, final_text_color);
             }
         }
 
@@ -25,22 +25,25 @@ U64 ui_text_view_coord_to_offset (UiBox *box, Vec2 coord) {
             continue;
         }
 
-        AtlasSlot *slot = font_get_atlas_slot(ui->font, glyph);
-
         F32 local_x = glyph->x - line_start_x_offset;
 
-        if (local_x + slot->advance > max_width && local_x > 0) {
+        if (local_x + glyph->x_advance > max_width && local_x > 0) {
             line_start_x_offset = glyph->x;
             current_y_offset += ui->font->height;
             local_x = 0;
         }
 
         F32 x0 = start_x + local_x;
-        F32 x1 = x0 + slot->advance;
+        F32 x1 = x0 + glyph->x_advance;
+        if (coord.x < x0 || coord.x > x1) continue;
+
+        // Only the glyphs under the coord get a slot, since that
+        // queues the rasterization of glyphs not in the atlas yet.
+        AtlasSlot *slot = font_get_atlas_slot(ui->font, glyph);
         F32 y0 = start_y + glyph->y + current_y_offset - descent - slot->bearing_y;
         F32 y1 = y0 + ui->font->height;
 
-        if (coord.y >= y0 && coord.y <= y1 && coord.x >= x0 && coord.x <= x1) {
+        if (coord.y >= y0 && coord.y <= y1) {
             return glyph->byte_offset;
         }
     }
@@ -51,8 +54,6 @@ U64 ui_text_view_coord_to_offset (UiBox *box, Vec2 coord) {
 static Void draw (UiBox *box) {
     if (! ui_set_font(box)) return;
 
-    dr_bind_texture(&ui->font->atlas_texture);
-
     UiTextView *info        = ui_get_box_data(box, 0, 0);
     F32 start_x             = box->rect.x;
     F32 start_y             = box->rect.y + ui->font->height;
@@ -60,6 +61,7 @@ static Void draw (UiBox *box) {
     F32 max_width           = box->rect.w;
     F32 line_start_x_offset = 0;
     F32 current_y_offset    = 0;
+    Rect clip               = array_get_last(&ui->clip_stack);
 
     array_iter (glyph, &info->glyphs, *) {
         if (glyph->codepoint == '\n') {
@@ -68,29 +70,25 @@ static Void draw (UiBox *box) {
             continue;
         }
 
-        AtlasSlot *slot = font_get_atlas_slot(ui->font, glyph);
-
         F32 local_x = glyph->x - line_start_x_offset;
 
-        if (local_x + slot->advance > max_width && local_x > 0) {
+        if (local_x + glyph->x_advance > max_width && local_x > 0) {
             line_start_x_offset = glyph->x;
             current_y_offset += ui->font->height;
             local_x = 0;
         }
 
-        Vec2 top_left = {
-            start_x + local_x + slot->bearing_x,
-            start_y + glyph->y + current_y_offset - descent - slot->bearing_y
-        };
-        Vec2 bottom_right = {top_left.x + slot->width, top_left.y + slot->height};
-
-        dr_rect(
-            .top_left          = top_left,
-            .bottom_right      = bottom_right,
-            .texture_rect      = {slot->x, slot->y, slot->width, slot->height},
-            .text_color        = box->style.text_color,
-            .text_is_grayscale = (slot->pixel_mode == FT_PIXEL_MODE_GRAY),
-        );
+        // Lines are culled against the clip. The glyphs of lines
+        // above it still have to be walked for the line wrapping,
+        // which only needs the shaped advances. Their atlas slots
+        // are not looked up, so they don't get rasterized.
+        F32 line_top = box->rect.y + current_y_offset - fabsf(descent);
+        if (line_top >= clip.y + clip.h) break;
+        if (line_top + ui->font->height + 2*fabsf(descent) <= clip.y) continue;
+
+        AtlasSlot *slot = font_get_atlas_slot(ui->font, glyph);
+        Vec2 pen = { start_x + local_x, start_y + glyph->y + current_y_offset - descent };
+        font_draw_glyph(slot, pen, box->style.text_color);
     }
 }
 
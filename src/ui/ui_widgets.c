@@ -98,10 +98,6 @@ static Void size_label (UiBox *box, U64 axis) {
 static Void draw_label (UiBox *box) {
     if (! ui_set_font(box)) return;
 
-    tmem_new(tm);
-
-    dr_bind_texture(&ui->font->atlas_texture);
-
     Bool first_frame     = box->start_frame == ui->frame;
     String text          = str(cast(CString, box->scratch));
     F32 x                = round(box->rect.x + box->style.padding.x);
@@ -110,7 +106,6 @@ static Void draw_label (UiBox *box) {
     F32 descent          = cast(F32, ui->font->descent);
     F32 width            = cast(F32, ui->font->width);
     F32 x_pos            = x;
-    SliceGlyphInfo infos = font_get_glyph_infos(ui->font, tm, text);
 
     // Compute available width:
     UiBox *parent = box->parent;
@@ -119,20 +114,37 @@ static Void draw_label (UiBox *box) {
         available_width = parent->rect.w - 2*parent->style.padding.x;
     }
 
+    // The label is a single line, so it's culled as a whole when
+    // the line is outside of the clip. A culled label still has to
+    // measure itself, but that is skipped if nothing that the size
+    // depends on changed since it was last measured.
+    Rect clip = array_get_last(&ui->clip_stack);
+    Bool culled = (clip.w <= 0) || (clip.h <= 0) || (y - ui->font->height - fabsf(descent) >= clip.y + clip.h) || (y + fabsf(descent) <= clip.y);
+
+    F32 params[] = { available_width, box->style.padding.x, box->style.padding.y, cast(F32, ui->font->id) };
+    U64 measure_hash = str_hash_seed(text, str_hash_seed((String){ .data=cast(Char*, params), .count=sizeof(params) }, 0));
+    if (culled && !first_frame && box->measure_hash == measure_hash) return;
+    box->measure_hash = measure_hash;
+
+    SliceGlyphInfo infos = font_get_shaped_run(ui->font, text);
+
+    // The label is measured from the shaped glyphs only. Atlas
+    // slots are looked up just for drawing, since a slot that is
+    // still pending has no metrics yet and looking one up queues
+    // the glyph for rasterization.
+
     // Compute width of ellipsis:
-    SliceGlyphInfo dots_infos = font_get_glyph_infos(ui->font, tm, str("..."));
+    SliceGlyphInfo dots_infos = font_get_shaped_run(ui->font, str("..."));
     F32 dots_width = 0;
     {
         GlyphInfo *last_info = array_ref_last(&dots_infos);
-        AtlasSlot *slot = font_get_atlas_slot(ui->font, last_info);
-        dots_width = ui->font->is_mono ? 3*width : (last_info->x + slot->bearing_x + last_info->x_advance);
+        dots_width = ui->font->is_mono ? 3*width : (last_info->x + last_info->x_advance);
     }
 
     // Compute line width:
     array_iter (info, &infos, *) {
-        AtlasSlot *slot = font_get_atlas_slot(ui->font, info);
         x_pos += width;
-        if (ARRAY_ITER_DONE) line_width = ui->font->is_mono ? (x_pos - x) : (info->x + slot->bearing_x + info->x_advance);
+        if (ARRAY_ITER_DONE) line_width = ui->font->is_mono ? (x_pos - x) : (info->x + info->x_advance);
     }
 
     // Don't draw ellipsis if we fit in available with:
@@ -140,55 +152,37 @@ static Void draw_label (UiBox *box) {
         available_width = -1.0;
     }
 
-    // Draw text:
+    Vec4 color = first_frame ? vec4(0,0,0,0) : box->style.text_color;
+
+    // Draw text. Without an ellipsis the glyphs are drawn at their
+    // shaped positions unless the font is mono:
     x_pos = x;
-    array_iter (info, &infos, *) {
-        AtlasSlot *slot = font_get_atlas_slot(ui->font, info);
-
-        F32 char_right_edge = ui->font->is_mono ? ((ARRAY_IDX + 1) * width) : (info->x + slot->bearing_x + info->x_advance);
-
-        // Draw ellipsis:
-        if (available_width > 0 && (char_right_edge + dots_width > available_width)) {
-            F32 dot_base_x = ui->font->is_mono ? x_pos : (x + info->x);
-
-            array_iter (info, &dots_infos, *) {
-                AtlasSlot *slot = font_get_atlas_slot(ui->font, info);
-                Vec2 top_left = {
-                    ui->font->is_mono ? (dot_base_x + slot->bearing_x) : (dot_base_x + info->x + slot->bearing_x),
-                    y + info->y - descent - slot->bearing_y
-                };
-                Vec2 bottom_right = {top_left.x + slot->width, top_left.y + slot->height};
-
-                dr_rect(
-                    .top_left          = top_left,
-                    .bottom_right      = bottom_right,
-                    .texture_rect      = {slot->x, slot->y, slot->width, slot->height},
-                    .text_color        = first_frame ? vec4(0,0,0,0) : box->style.text_color,
-                    .text_is_grayscale = (slot->pixel_mode == FT_PIXEL_MODE_GRAY),
-                );
+    if (available_width < 0 && !ui->font->is_mono) {
+        if (! culled) dr_glyph_run(ui->font, infos, (Vec2){x, y - descent}, color);
+    } else {
+        array_iter (info, &infos, *) {
+            F32 char_right_edge = ui->font->is_mono ? ((ARRAY_IDX + 1) * width) : (info->x + info->x_advance);
 
-                if (ui->font->is_mono) dot_base_x += width;
-            }
+            // Draw ellipsis:
+            if (available_width > 0 && (char_right_edge + dots_width > available_width)) {
+                F32 dot_base_x = ui->font->is_mono ? x_pos : (x + info->x);
 
-            line_width = ui->font->is_mono ? (dot_base_x - x) : (info->x + dots_width);
-            break;
-        }
+                array_iter (info, &dots_infos, *) {
+                    Vec2 pen = { ui->font->is_mono ? dot_base_x : (dot_base_x + info->x), y + info->y - descent };
+                    if (! culled) font_draw_glyph(font_get_atlas_slot(ui->font, info), pen, color);
 
-        Vec2 top_left = {
-            ui->font->is_mono ? (x_pos + slot->bearing_x) : (x + info->x + slot->bearing_x),
-            y + info->y - descent - slot->bearing_y
-        };
-        Vec2 bottom_right = {top_left.x + slot->width, top_left.y + slot->height};
+                    if (ui->font->is_mono) dot_base_x += width;
+                }
 
-        dr_rect(
-            .top_left          = top_left,
-            .bottom_right      = bottom_right,
-            .texture_rect      = {slot->x, slot->y, slot->width, slot->height},
-            .text_color        = first_frame ? vec4(0,0,0,0) : box->style.text_color,
-            .text_is_grayscale = (slot->pixel_mode == FT_PIXEL_MODE_GRAY),
-        );
+                line_width = ui->font->is_mono ? (dot_base_x - x) : (info->x + dots_width);
+                break;
+            }
 
-        x_pos += width;
+            Vec2 pen = { ui->font->is_mono ? x_pos : (x + info->x), y + info->y - descent };
+            if (! culled) font_draw_glyph(font_get_atlas_slot(ui->font, info), pen, color);
+
+            x_pos += width;
+        }
     }
 
     box->rect.w = line_width + 2*box->style.padding.x;
@@ -275,7 +269,7 @@ istruct (UiImage) {
 
 static Void draw_image (UiBox *box) {
     Auto info = cast(UiImage *, box->scratch);
-    dr_flush_vertices();
+    if (! info->texture) return;
     dr_bind_texture(info->texture);
     dr_rect(
         .top_left          = box->rect.top_left,
@@ -287,8 +281,13 @@ static Void draw_image (UiBox *box) {
     );
 }
 
-UiBox *ui_image (CString id, Texture *texture, Bool blur, Vec4 tint, F32 pref_width) {
-    UiBox *img = ui_box(UI_BOX_INVISIBLE, id) {
+// Until a texture of the image is resident a placeholder with
+// the background color is drawn. It's square until the size of
+// the image is known.
+UiBox *ui_image (CString id, DrImage *image, Bool blur, Vec4 tint, F32 pref_width) {
+    Texture *texture = dr_image_texture(image, pref_width);
+
+    UiBox *img = ui_box(texture ? UI_BOX_INVISIBLE : 0, id) {
         img->draw_fn = draw_image;
         UiImage *info = mem_new(ui->frame_mem, UiImage);
         info->texture = texture;
@@ -296,9 +295,11 @@ UiBox *ui_image (CString id, Texture *texture, Bool blur, Vec4 tint, F32 pref_wi
         info->tint = tint;
         info->pref_width = pref_width;
         img->scratch = cast(U64, info);
+        F32 height = image->width ? round(image->height * (info->pref_width / image->width)) : info->pref_width;
         ui_style_size(UI_WIDTH, (UiSize){UI_SIZE_PIXELS, info->pref_width, 1});
-        ui_style_size(UI_HEIGHT, (UiSize){UI_SIZE_PIXELS, round(texture->height * (info->pref_width / texture->width)), 1});
+        ui_style_size(UI_HEIGHT, (UiSize){UI_SIZE_PIXELS, height, 1});
         ui_style_from_config(UI_RADIUS, UI_CONFIG_RADIUS_2);
+        if (! texture) ui_style_from_config(UI_BG_COLOR, UI_CONFIG_BG_3);
 
         ui_box(0, "overlay") {
             ui_style_size(UI_WIDTH, (UiSize){ UI_SIZE_PCT_PARENT, 1, 1});
@@ -1145,15 +1146,13 @@ static Void draw_color_sat_val_picker (UiBox *box) {
         .color2       = {-1},
     );
 
-    SliceVertex v = dr_rect(
-        .top_left     = r->top_left,
-        .bottom_right = {r->x+r->w, r->y+r->h},
-        .color        = {1, 1, 1, 0},
-        .color2       = {-1},
+    dr_rect(
+        .top_left            = r->top_left,
+        .bottom_right        = {r->x+r->w, r->y+r->h},
+        .color               = {1, 1, 1, 1},
+        .color2              = {1, 1, 1, 0},
+        .horizontal_gradient = true,
     );
-    v.data[0].color = vec4(1, 1, 1, 1);
-    v.data[1].color = vec4(1, 1, 1, 1);
-    v.data[5].color = vec4(1, 1, 1, 1);
 
     dr_rect(
         .top_left     = r->top_left,
@@ -2,45 +2,69 @@
 
 out vec4 out_color;
 
+uniform int pass; // 0 = downsample, 1 = upsample, 2 = draw the rect.
+uniform float source_scale; // Resolution of tex relative to the target.
 uniform vec2 center;
 uniform vec4 radius;
 uniform vec2 half_size;
-uniform bool horizontal;
-uniform int blur_radius;
-uniform bool do_blurring;
-uniform float blur_shrink;
+uniform vec2 source_size; // Texels of tex that are in use.
 uniform sampler2D tex;
 
+vec2 uv_max;
+
+// Pooled textures are bigger than the area in use, and what lies
+// outside of it was never drawn, so taps are kept half a texel
+// inside of the area for bilinear filtering not to reach it.
+vec3 tap (vec2 uv) {
+    return texture(tex, min(uv, uv_max)).rgb;
+}
+
 float rect_sdf (vec2 frag_pos, vec2 center, vec2 half_size, float radius) {
     return length(max(abs(frag_pos - center) - half_size + radius, 0.0)) - radius;
 }
 
+// The diagonal samples land on texel corners, so with bilinear
+// filtering the 5 samples cover a 4x4 block of texels.
+vec3 downsample (vec2 uv, vec2 texel) {
+    vec3 result = tap(uv) * 4.0;
+    result += tap(uv - texel);
+    result += tap(uv + texel);
+    result += tap(uv + vec2(texel.x, -texel.y));
+    result += tap(uv - vec2(texel.x, -texel.y));
+    return result / 8.0;
+}
+
+vec3 upsample (vec2 uv, vec2 texel) {
+    vec3 result = tap(uv + vec2(-texel.x, 0.0));
+    result += tap(uv + vec2(texel.x, 0.0));
+    result += tap(uv + vec2(0.0, -texel.y));
+    result += tap(uv + vec2(0.0, texel.y));
+    result += tap(uv + 0.5*vec2(-texel.x, -texel.y)) * 2.0;
+    result += tap(uv + 0.5*vec2(-texel.x, texel.y)) * 2.0;
+    result += tap(uv + 0.5*vec2(texel.x, -texel.y)) * 2.0;
+    result += tap(uv + 0.5*vec2(texel.x, texel.y)) * 2.0;
+    return result / 12.0;
+}
+
 void main () {
+    // The textures can be bigger than the area in use, so uv's
+    // are computed from the texture size.
     vec2 frag_pos = gl_FragCoord.xy;
+    vec2 texel = 1.0 / textureSize(tex, 0);
+    vec2 uv = frag_pos * source_scale * texel;
+    uv_max = (source_size - 0.5) * texel;
     vec3 result;
 
-    if (do_blurring) {
-        vec2 tex_pos = frag_pos / textureSize(tex, 0);
-        vec2 tex_offset = 1.0 / textureSize(tex, 0);
-        result = texture(tex, tex_pos).rgb / (2*blur_radius - 1);
-
-        if (horizontal) {
-            for(int i = 1; i < blur_radius; ++i) {
-                result += texture(tex, tex_pos + vec2(tex_offset.x * i, 0.0)).rgb / (2*blur_radius - 1);
-                result += texture(tex, tex_pos - vec2(tex_offset.x * i, 0.0)).rgb / (2*blur_radius - 1);
-            }
-        } else {
-            for(int i = 1; i < blur_radius; ++i) {
-                result += texture(tex, tex_pos + vec2(0.0, tex_offset.y * i)).rgb / (2*blur_radius - 1);
-                result += texture(tex, tex_pos - vec2(0.0, tex_offset.y * i)).rgb / (2*blur_radius - 1);
-            }
-        }
+    if (pass == 0) {
+        result = downsample(uv, texel);
+    } else if (pass == 1) {
+        result = upsample(uv, texel);
     } else {
         vec2 fpc = frag_pos - center;
         float r  = (fpc.x > 0.0) ? ((fpc.y > 0.0) ? radius.x : radius.z) : ((fpc.y > 0.0) ? radius.y : radius.w);
         float d  = rect_sdf(frag_pos, center, half_size, r);
         if (d > 0) discard;
-        result = texture(tex, (frag_pos / blur_shrink) / textureSize(tex, 0).xy).rgb;
+        result = upsample(uv, texel);
     }
 
     out_color = vec4(result, 1.0);
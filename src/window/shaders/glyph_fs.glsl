@@ -0,0 +1,30 @@
+#version 450 core
+
+out vec4 frag_color;
+
+flat in vec4 color;
+flat in uint texture_slot;
+flat in uint is_grayscale;
+in vec2 uv;
+
+// Must match MAX_TEXTURE_UNITS in window.c.
+uniform sampler2D textures[8];
+
+// See sample_texture() in rect_fs.glsl.
+vec4 sample_texture (uint slot, vec2 uv) {
+    switch (slot) {
+    case 0:  return texture(textures[0], uv);
+    case 1:  return texture(textures[1], uv);
+    case 2:  return texture(textures[2], uv);
+    case 3:  return texture(textures[3], uv);
+    case 4:  return texture(textures[4], uv);
+    case 5:  return texture(textures[5], uv);
+    case 6:  return texture(textures[6], uv);
+    default: return texture(textures[7], uv);
+    }
+}
+
+void main () {
+    frag_color = sample_texture(texture_slot, uv);
+    if (is_grayscale != 0) frag_color *= color;
+}
@@ -0,0 +1,45 @@
+#version 450 core
+
+// Per vertex:
+layout (location = 0) in vec2 v_corner; // Corner of the unit quad with +y=down.
+
+// Per instance:
+layout (location = 1) in vec2  v_top_left;
+layout (location = 2) in uvec4 v_atlas_rect; // x, y, width, height.
+layout (location = 3) in uint  v_color;
+layout (location = 4) in uint  v_flags; // Texture slot in the low byte, grayscale in bit 8.
+
+flat out vec4 color;
+flat out uint texture_slot;
+flat out uint is_grayscale;
+out vec2 uv;
+
+uniform mat4 projection;
+
+// Must match MAX_TEXTURE_UNITS in window.c.
+uniform sampler2D textures[8];
+
+vec2 texture_size (uint slot) {
+    switch (slot) {
+    case 0:  return textureSize(textures[0], 0);
+    case 1:  return textureSize(textures[1], 0);
+    case 2:  return textureSize(textures[2], 0);
+    case 3:  return textureSize(textures[3], 0);
+    case 4:  return textureSize(textures[4], 0);
+    case 5:  return textureSize(textures[5], 0);
+    case 6:  return textureSize(textures[6], 0);
+    default: return textureSize(textures[7], 0);
+    }
+}
+
+void main () {
+    vec2 size         = vec2(v_atlas_rect.zw);
+    vec2 top_left     = v_top_left;
+    vec2 bottom_right = vec2(top_left.x + size.x, top_left.y - size.y);
+
+    gl_Position  = projection * vec4(mix(top_left, bottom_right, v_corner), 0, 1.0);
+    color        = unpackUnorm4x8(v_color);
+    texture_slot = v_flags & 0xffu;
+    is_grayscale = v_flags >> 8;
+    uv           = (vec2(v_atlas_rect.xy) + v_corner * size) / texture_size(texture_slot);
+}
@@ -1,5 +1,14 @@
 #version 450 core
 
+// This file is compiled into several programs, each specialized
+// for a kind of rect by one of these defines (see DrPipeline in
+// window.c):
+//
+//     VARIANT_TEXTURED: Textured rect without any decorations (images).
+//     VARIANT_FLAT:     Solid or gradient rect with sharp corners.
+//     VARIANT_ROUNDED:  Like flat but with rounded corners and borders.
+//     VARIANT_FULL:     Everything, including textures and shadows.
+
 out vec4 frag_color;
 
 in vec4 color;
@@ -17,11 +26,28 @@ flat in vec2 half_size;
 flat in vec2 top_left;
 flat in vec4 text_color;
 flat in float text_is_grayscale;
+flat in uint texture_slot;
 in vec2 uv;
 
 const float pi = 3.141592653589793;
 
-uniform sampler2D tex;
+// Must match MAX_TEXTURE_UNITS in window.c.
+uniform sampler2D textures[8];
+
+// Indexing an array of samplers with a value that isn't uniform
+// across the draw call is undefined, so we use constant indices.
+vec4 sample_texture (uint slot, vec2 uv) {
+    switch (slot) {
+    case 0:  return texture(textures[0], uv);
+    case 1:  return texture(textures[1], uv);
+    case 2:  return texture(textures[2], uv);
+    case 3:  return texture(textures[3], uv);
+    case 4:  return texture(textures[4], uv);
+    case 5:  return texture(textures[5], uv);
+    case 6:  return texture(textures[6], uv);
+    default: return texture(textures[7], uv);
+    }
+}
 
 // A standard gaussian function, used for weighting samples
 float gaussian (float x, float sigma) {
@@ -79,14 +105,35 @@ float select_border_width (vec2 p, vec2 half_size, vec4 borders) {
     return 0;
 }
 
+#if defined(VARIANT_TEXTURED)
+
+// The quad is the textured box itself and there is no edge
+// softness, so every fragment is fully inside of it.
+void main () {
+    frag_color = sample_texture(texture_slot, uv);
+    if (text_is_grayscale > 0) frag_color *= text_color;
+}
+
+#elif defined(VARIANT_FLAT)
+
+void main () {
+    vec2 d = abs(gl_FragCoord.xy - center) - half_size;
+    frag_color = color;
+    frag_color.a *= 1.0 - smoothstep(0.0, edge_softness, length(max(d, 0.0)));
+}
+
+#else
+
 void main () {
     frag_color = color;
     vec2 frag_pos = gl_FragCoord.xy;
 
+#if defined(VARIANT_FULL)
     if (text_color.w > 0) {
-        frag_color = texture(tex, uv/textureSize(tex, 0));
+        frag_color = sample_texture(texture_slot, uv);
         if (text_is_grayscale > 0) frag_color *= text_color;
     }
+#endif
 
     vec2 fpc = frag_pos - center;
     float r = (fpc.x > 0.0) ? ((fpc.y > 0.0) ? radius.x : radius.z) : ((fpc.y > 0.0) ? radius.y : radius.w);
@@ -95,6 +142,7 @@ void main () {
     float dist_outer_smooth = 1.0 - smoothstep(0.0, edge_softness, dist_outer);
     frag_color.a *= dist_outer_smooth;
 
+#if defined(VARIANT_FULL)
     if (inset_shadow_width > 0.001) {
         vec4 ic = inset_shadow_color;
         ic.a *= 1 - box_shadow(half_size, fpc, inset_shadow_width, r);
@@ -102,6 +150,7 @@ void main () {
         frag_color = mix(frag_color, vec4(ic.rgb, 1.0), shadow_alpha);
         frag_color.a *= dist_outer_smooth;
     }
+#endif
 
     if (border_widths.x > 0.001 || border_widths.y > 0.001 || border_widths.z > 0.001 || border_widths.w > 0.001) {
         float b = select_border_width(fpc, half_size - r, border_widths);
@@ -111,9 +160,13 @@ void main () {
         frag_color.a *= dist_outer_smooth;
     }
 
+#if defined(VARIANT_FULL)
     if (outset_shadow_width > 0.001) {
         vec4 oc = outset_shadow_color;
         oc.a *= box_shadow(half_size + edge_softness, fpc - shadow_offsets, outset_shadow_width, r);
         frag_color = mix(frag_color, oc, 1.0 - dist_outer_smooth);
     }
+#endif
 }
+
+#endif
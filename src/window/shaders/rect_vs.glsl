@@ -1,21 +1,21 @@
 #version 450 core
 
-layout (location = 0) in vec2  v_position;
-layout (location = 1) in vec4  v_color;
-layout (location = 2) in vec2  v_bottom_right;
-layout (location = 3) in vec2  v_top_left;
-layout (location = 4) in vec4 v_radius;
-layout (location = 5) in float v_edge_softness;
-layout (location = 6) in vec4  v_border_color;
-layout (location = 7) in vec4 v_border_widths;
-layout (location = 8) in vec4 v_inset_shadow_color;
-layout (location = 9) in vec4 v_outset_shadow_color;
-layout (location = 10) in float v_outset_shadow_width;
-layout (location = 11) in float v_inset_shadow_width;
-layout (location = 12) in vec2 v_shadow_offsets;
-layout (location = 13) in vec2 v_uv;
-layout (location = 14) in vec4 v_text_color;
-layout (location = 15) in float v_text_is_grayscale;
+// Per vertex:
+layout (location = 0) in vec2 v_corner; // Corner of the unit quad with +y=down.
+
+// Per instance:
+layout (location = 1)  in vec4  v_rect; // Top left and bottom right corners.
+layout (location = 2)  in vec4  v_radius;
+layout (location = 3)  in vec4  v_border_widths;
+layout (location = 4)  in vec4  v_texture_rect;
+layout (location = 5)  in vec2  v_shadow_offsets;
+layout (location = 6)  in float v_edge_softness;
+layout (location = 7)  in float v_outset_shadow_width;
+layout (location = 8)  in float v_inset_shadow_width;
+layout (location = 9)  in float v_text_is_grayscale;
+layout (location = 10) in uvec4 v_colors; // Top left, bottom left, bottom right, top right.
+layout (location = 11) in uvec4 v_colors2; // Border, inset shadow, outset shadow, text.
+layout (location = 12) in uint  v_texture_slot;
 
 out vec4 color;
 flat out vec4 radius;
@@ -31,25 +31,47 @@ flat out vec2 center;
 flat out vec2 half_size;
 flat out vec4 text_color;
 flat out float text_is_grayscale;
+flat out uint texture_slot;
 out vec2 uv;
 
 uniform mat4 projection;
 
+// Must match MAX_TEXTURE_UNITS in window.c.
+uniform sampler2D textures[8];
+
+vec2 texture_size (uint slot) {
+    switch (slot) {
+    case 0:  return textureSize(textures[0], 0);
+    case 1:  return textureSize(textures[1], 0);
+    case 2:  return textureSize(textures[2], 0);
+    case 3:  return textureSize(textures[3], 0);
+    case 4:  return textureSize(textures[4], 0);
+    case 5:  return textureSize(textures[5], 0);
+    case 6:  return textureSize(textures[6], 0);
+    default: return textureSize(textures[7], 0);
+    }
+}
+
 void main () {
-    gl_Position         = projection * vec4(v_position, 0, 1.0);
-    color               = v_color;
+    vec2 top_left     = v_rect.xy;
+    vec2 bottom_right = v_rect.zw;
+    int corner        = (v_corner.x == 0) ? int(v_corner.y) : 3 - int(v_corner.y);
+
+    gl_Position         = projection * vec4(mix(top_left, bottom_right, v_corner), 0, 1.0);
+    color               = unpackUnorm4x8(v_colors[corner]);
     radius              = v_radius;
     edge_softness       = v_edge_softness;
-    border_color        = v_border_color;
+    border_color        = unpackUnorm4x8(v_colors2.x);
     border_widths       = v_border_widths;
-    inset_shadow_color  = v_inset_shadow_color;
-    outset_shadow_color = v_outset_shadow_color;
+    inset_shadow_color  = unpackUnorm4x8(v_colors2.y);
+    outset_shadow_color = unpackUnorm4x8(v_colors2.z);
     outset_shadow_width = v_outset_shadow_width;
     inset_shadow_width  = v_inset_shadow_width;
     shadow_offsets      = v_shadow_offsets;
-    center              = (v_top_left + v_bottom_right) * 0.5;
-    half_size           = abs(v_top_left - v_bottom_right) * 0.5 - 2*v_outset_shadow_width - 2*v_edge_softness;
-    text_color          = v_text_color;
+    center              = (top_left + bottom_right) * 0.5;
+    half_size           = abs(top_left - bottom_right) * 0.5 - 2*v_outset_shadow_width - 2*v_edge_softness;
+    text_color          = unpackUnorm4x8(v_colors2.w);
     text_is_grayscale   = v_text_is_grayscale;
-    uv                  = v_uv;
+    texture_slot        = v_texture_slot;
+    uv                  = (v_texture_rect.xy + v_corner * v_texture_rect.zw) / texture_size(v_texture_slot);
 }
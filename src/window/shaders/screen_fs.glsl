@@ -3,7 +3,8 @@
 out vec4 color;
 in vec2 tex_coords;
 uniform sampler2D tex;
+uniform vec2 uv_scale; // The texture can be bigger than the window.
 
 void main () { 
-    color = texture(tex, tex_coords);
+    color = texture(tex, tex_coords * uv_scale);
 }
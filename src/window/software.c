@@ -0,0 +1,561 @@
+#include "base/mem.h"
+#include "base/math.h"
+#include "base/tpool.h"
+#include "window/software.h"
+#include "vendor/plutovg/src/plutovg.h"
+
+#define SW_MAX_THREADS 16
+
+istruct (SwJob) {
+    RectInstance *rects;
+    U32 count;
+    U32 texture_count;
+    U32 textures[SW_MAX_TEXTURE_SLOTS];
+    Int clip[4];
+};
+
+istruct (SwBand) {
+    Int y0;
+    Int y1;
+};
+
+static TPool *sw_pool;
+static plutovg_surface_t *sw_surface;
+static Array(plutovg_surface_t*) sw_textures; // Index is the texture id minus 1.
+static Array(U32) sw_free_textures; // Ids that sw_texture_new() hands out again.
+static Array(SwJob) sw_jobs;
+
+// =============================================================================
+// Pixels:
+// -------
+//
+// Surfaces hold premultiplied ARGB32 while the colors we shade
+// with are not premultiplied, just like in the rect shader.
+// =============================================================================
+static Vec4 unpack_color (U32 c) {
+    return vec4((c & 0xff) / 255.f, ((c >> 8) & 0xff) / 255.f, ((c >> 16) & 0xff) / 255.f, (c >> 24) / 255.f);
+}
+
+static Vec4 mix4 (Vec4 a, Vec4 b, F32 t) {
+    return vec4(a.x + (b.x - a.x)*t, a.y + (b.y - a.y)*t, a.z + (b.z - a.z)*t, a.w + (b.w - a.w)*t);
+}
+
+static Void blend (U32 *dst, Vec4 c) {
+    F32 a = clamp(c.w, 0.f, 1.f);
+    if (a <= 0) return;
+
+    U32 d = *dst;
+    F32 k = 1 - a;
+    U32 r = cast(U32, clamp(c.x, 0.f, 1.f) * a * 255 + ((d >> 16) & 0xff) * k + .5f);
+    U32 g = cast(U32, clamp(c.y, 0.f, 1.f) * a * 255 + ((d >> 8) & 0xff) * k + .5f);
+    U32 b = cast(U32, clamp(c.z, 0.f, 1.f) * a * 255 + (d & 0xff) * k + .5f);
+    U32 o = cast(U32, a * 255 + (d >> 24) * k + .5f);
+    *dst = (o << 24) | (r << 16) | (g << 8) | b;
+}
+
+// Bilinear with clamping to the edge. The uv's are in texels.
+static Vec4 sample_texture (plutovg_surface_t *texture, F32 u, F32 v) {
+    Int w = plutovg_surface_get_width(texture);
+    Int h = plutovg_surface_get_height(texture);
+    Int stride = plutovg_surface_get_stride(texture) / 4;
+    U32 *pixels = cast(U32*, plutovg_surface_get_data(texture));
+
+    u -= .5f;
+    v -= .5f;
+    Int x = cast(Int, floorf(u));
+    Int y = cast(Int, floorf(v));
+    F32 fx = u - x;
+    F32 fy = v - y;
+    Int xs[2] = { clamp(x, 0, w - 1), clamp(x + 1, 0, w - 1) };
+    Int ys[2] = { clamp(y, 0, h - 1), clamp(y + 1, 0, h - 1) };
+
+    F32 sum[4] = {};
+    for (U32 j = 0; j < 2; ++j) {
+        for (U32 i = 0; i < 2; ++i) {
+            U32 p = pixels[ys[j]*stride + xs[i]];
+            F32 weight = (i ? fx : 1 - fx) * (j ? fy : 1 - fy);
+            sum[0] += ((p >> 16) & 0xff) * weight;
+            sum[1] += ((p >> 8) & 0xff) * weight;
+            sum[2] += (p & 0xff) * weight;
+            sum[3] += (p >> 24) * weight;
+        }
+    }
+
+    if (sum[3] <= 0) return vec4(0, 0, 0, 0);
+    return vec4(sum[0] / sum[3], sum[1] / sum[3], sum[2] / sum[3], sum[3] / 255);
+}
+
+// =============================================================================
+// Rect shading:
+// -------------
+//
+// This is a port of rect_fs.glsl. It's used for rects with a
+// texture or shadows. The other rects are filled by plutovg
+// which is a lot faster since it only touches the edges with
+// antialiasing. Coordinates are window coordinates with +y=down
+// so the y of points handed to the shadow code gets flipped.
+// =============================================================================
+static F32 smoothstep (F32 edge0, F32 edge1, F32 x) {
+    if (edge1 <= edge0) return (x <= edge0) ? 0 : 1; // What GPUs do with a softness of 0.
+    F32 t = clamp((x - edge0) / (edge1 - edge0), 0.f, 1.f);
+    return t * t * (3 - 2*t);
+}
+
+static F32 rect_sdf (F32 x, F32 y, F32 half_w, F32 half_h, F32 radius) {
+    F32 dx = max(fabsf(x) - half_w + radius, 0.f);
+    F32 dy = max(fabsf(y) - half_h + radius, 0.f);
+    return sqrtf(dx*dx + dy*dy) - radius;
+}
+
+static F32 gaussian (F32 x, F32 sigma) {
+    return expf(-(x * x) / (2 * sigma * sigma)) / (sqrtf(2 * PI) * sigma);
+}
+
+static F32 erf_approx (F32 x) {
+    F32 s = (x > 0) - (x < 0);
+    F32 a = fabsf(x);
+    x = 1 + (0.278393f + (0.230389f + 0.078108f * (a * a)) * a) * a;
+    x *= x;
+    return s - s / (x * x);
+}
+
+static F32 box_shadow_x (F32 x, F32 y, F32 sigma, F32 corner, F32 half_w, F32 half_h) {
+    F32 delta  = min(half_h - corner - fabsf(y), 0.f);
+    F32 curved = half_w - corner + sqrtf(max(0.f, corner * corner - delta * delta));
+    F32 lo     = .5f + .5f * erf_approx((x - curved) * (sqrtf(.5f) / sigma));
+    F32 hi     = .5f + .5f * erf_approx((x + curved) * (sqrtf(.5f) / sigma));
+    return hi - lo;
+}
+
+static F32 box_shadow (F32 half_w, F32 half_h, F32 x, F32 y, F32 sigma, F32 corner) {
+    sigma = max(sigma, .001f);
+
+    F32 start = clamp(-3 * sigma, y - half_h, y + half_h);
+    F32 end   = clamp(3 * sigma, y - half_h, y + half_h);
+    F32 step  = (end - start) / 4;
+    F32 s     = start + step * .5f;
+    F32 value = 0;
+
+    for (U32 i = 0; i < 4; i++) {
+        value += box_shadow_x(x, y - s, sigma, corner, half_w, half_h) * gaussian(s, sigma) * step;
+        s += step;
+    }
+
+    return value;
+}
+
+// The x and y are relative to the center with +y=up.
+static F32 select_border_width (F32 x, F32 y, F32 half_w, F32 half_h, Vec4 borders) {
+    if (y > (half_h - borders.y)) return borders.y;
+    if (y < (-half_h + borders.w)) return borders.w;
+    if (x > (half_w - borders.x)) return borders.x;
+    if (x < (-half_w + borders.z)) return borders.z;
+    return 0;
+}
+
+// The radius of the corner closest to the point relative to the
+// center of the rect with +y=down.
+static F32 select_radius (F32 x, F32 y, Vec4 radius) {
+    return (x > 0) ? ((y < 0) ? radius.x : radius.z) : ((y < 0) ? radius.y : radius.w);
+}
+
+// The quad is x0, y0, x1, y1 and the box the pixels to shade.
+static Void shade_rect (SwJob *job, RectInstance *r, F32 *quad, Int *box) {
+    F32 margin    = 2*r->outset_shadow_width + 2*r->edge_softness;
+    F32 cx        = (quad[0] + quad[2]) / 2;
+    F32 cy        = (quad[1] + quad[3]) / 2;
+    F32 half_w    = fabsf(quad[2] - quad[0]) / 2 - margin;
+    F32 half_h    = fabsf(quad[3] - quad[1]) / 2 - margin;
+    F32 soft      = r->edge_softness;
+    Vec4 colors[] = { unpack_color(r->colors[0]), unpack_color(r->colors[1]), unpack_color(r->colors[2]), unpack_color(r->colors[3]) };
+    Vec4 border   = unpack_color(r->border_color);
+    Vec4 inset    = unpack_color(r->inset_shadow_color);
+    Vec4 outset   = unpack_color(r->outset_shadow_color);
+    Vec4 text     = unpack_color(r->text_color);
+    Vec4 b        = r->border_widths;
+    Bool bordered = b.x > .001f || b.y > .001f || b.z > .001f || b.w > .001f;
+
+    plutovg_surface_t *texture = 0;
+    if (text.w > 0 && r->texture_slot < job->texture_count) {
+        U32 id = job->textures[r->texture_slot];
+        if (id && id <= sw_textures.count) texture = array_get(&sw_textures, id - 1);
+    }
+
+    U32 *pixels = cast(U32*, plutovg_surface_get_data(sw_surface));
+    Int stride  = plutovg_surface_get_stride(sw_surface) / 4;
+
+    for (Int py = box[1]; py < box[3]; ++py) {
+        U32 *row = pixels + py*stride;
+        F32 fy   = py + .5f;
+        F32 ty   = (fy - quad[1]) / (quad[3] - quad[1]);
+
+        for (Int px = box[0]; px < box[2]; ++px) {
+            F32 fx = px + .5f;
+            F32 tx = (fx - quad[0]) / (quad[2] - quad[0]);
+            Vec4 c;
+
+            if (texture) {
+                c = sample_texture(texture, r->texture_rect.x + tx*r->texture_rect.z, r->texture_rect.y + ty*r->texture_rect.w);
+                if (r->text_is_grayscale > 0) c = vec4(c.x*text.x, c.y*text.y, c.z*text.z, c.w*text.w);
+            } else {
+                c = mix4(mix4(colors[0], colors[3], tx), mix4(colors[1], colors[2], tx), ty);
+            }
+
+            F32 x = fx - cx;
+            F32 y = fy - cy;
+            F32 radius = select_radius(x, y, r->radius);
+            F32 outer = 1 - smoothstep(0, soft, rect_sdf(x, y, half_w, half_h, radius));
+            c.w *= outer;
+
+            if (r->inset_shadow_width > .001f) {
+                Vec4 ic = inset;
+                ic.w *= 1 - box_shadow(half_w, half_h, x, -y, r->inset_shadow_width, radius);
+                c = mix4(c, vec4(ic.x, ic.y, ic.z, 1), 1 - powf(1 - ic.w, 8));
+                c.w *= outer;
+            }
+
+            if (bordered) {
+                F32 w = select_border_width(x, -y, half_w - radius, half_h - radius, b);
+                F32 inner = smoothstep(0, soft, rect_sdf(x, y, half_w - w, half_h - w, max(radius - w, 0.f)));
+                c = mix4(c, border, inner);
+                c.w *= outer;
+            }
+
+            if (r->outset_shadow_width > .001f) {
+                Vec4 oc = outset;
+                oc.w *= box_shadow(half_w + soft, half_h + soft, x - r->shadow_offsets.x, -y - r->shadow_offsets.y, r->outset_shadow_width, radius);
+                c = mix4(c, oc, 1 - outer);
+            }
+
+            blend(&row[px], c);
+        }
+    }
+}
+
+// =============================================================================
+// Vector fills:
+// =============================================================================
+static plutovg_color_t to_plutovg_color (Vec4 c) {
+    return (plutovg_color_t){ c.x, c.y, c.z, c.w };
+}
+
+// The radii are top left, top right, bottom right, bottom left.
+static Void add_round_rect (plutovg_canvas_t *canvas, F32 x0, F32 y0, F32 x1, F32 y1, F32 *radii) {
+    F32 k = 1 - .5522848f; // Places the control points of a cubic that approximates a quarter circle.
+    F32 r[4];
+    for (U32 i = 0; i < 4; ++i) r[i] = clamp(radii[i], 0.f, min(x1 - x0, y1 - y0) / 2);
+
+    plutovg_canvas_move_to(canvas, x0 + r[0], y0);
+    plutovg_canvas_line_to(canvas, x1 - r[1], y0);
+    plutovg_canvas_cubic_to(canvas, x1 - r[1]*k, y0, x1, y0 + r[1]*k, x1, y0 + r[1]);
+    plutovg_canvas_line_to(canvas, x1, y1 - r[2]);
+    plutovg_canvas_cubic_to(canvas, x1, y1 - r[2]*k, x1 - r[2]*k, y1, x1 - r[2], y1);
+    plutovg_canvas_line_to(canvas, x0 + r[3], y1);
+    plutovg_canvas_cubic_to(canvas, x0 + r[3]*k, y1, x0, y1 - r[3]*k, x0, y1 - r[3]);
+    plutovg_canvas_line_to(canvas, x0, y0 + r[0]);
+    plutovg_canvas_cubic_to(canvas, x0, y0 + r[0]*k, x0 + r[0]*k, y0, x0 + r[0], y0);
+    plutovg_canvas_close_path(canvas);
+}
+
+// The shader fades the edge out over the edge softness starting
+// at the shape, while plutovg antialiases over a pixel centered
+// on the path, so the path is put halfway through the fade.
+static Void fill_rect (plutovg_canvas_t *canvas, RectInstance *r, F32 *quad) {
+    F32 margin = 2*r->edge_softness;
+    F32 e      = r->edge_softness / 2;
+    F32 x0     = quad[0] + margin - e;
+    F32 y0     = quad[1] + margin - e;
+    F32 x1     = quad[2] - margin + e;
+    F32 y1     = quad[3] - margin + e;
+    if (x1 <= x0 || y1 <= y0) return;
+
+    Vec4 rad   = r->radius;
+    F32 radii[] = { rad.y + e, rad.x + e, rad.z + e, rad.w + e };
+    Vec4 c0    = unpack_color(r->colors[0]);
+    Vec4 c1    = unpack_color(r->colors[1]);
+    Vec4 c3    = unpack_color(r->colors[3]);
+
+    if (c0.w > 0 || c1.w > 0 || c3.w > 0) {
+        add_round_rect(canvas, x0, y0, x1, y1, radii);
+
+        if (r->colors[0] != r->colors[1]) {
+            plutovg_gradient_stop_t stops[] = { { 0, to_plutovg_color(c0) }, { 1, to_plutovg_color(c1) } };
+            plutovg_canvas_set_linear_gradient(canvas, 0, quad[1], 0, quad[3], PLUTOVG_SPREAD_METHOD_PAD, stops, 2, 0);
+        } else if (r->colors[0] != r->colors[3]) {
+            plutovg_gradient_stop_t stops[] = { { 0, to_plutovg_color(c0) }, { 1, to_plutovg_color(c3) } };
+            plutovg_canvas_set_linear_gradient(canvas, quad[0], 0, quad[2], 0, PLUTOVG_SPREAD_METHOD_PAD, stops, 2, 0);
+        } else {
+            plutovg_canvas_set_rgba(canvas, c0.x, c0.y, c0.z, c0.w);
+        }
+
+        plutovg_canvas_fill(canvas);
+    }
+
+    // Border widths are right, top, left, bottom.
+    Vec4 b = r->border_widths;
+    Vec4 border = unpack_color(r->border_color);
+    if (border.w <= 0 || (b.x <= .001f && b.y <= .001f && b.z <= .001f && b.w <= .001f)) return;
+
+    add_round_rect(canvas, x0, y0, x1, y1, radii);
+
+    F32 ix0 = x0 + b.z;
+    F32 iy0 = y0 + b.y;
+    F32 ix1 = x1 - b.x;
+    F32 iy1 = y1 - b.w;
+
+    if (ix1 > ix0 && iy1 > iy0) {
+        F32 inner[] = {
+            max(radii[0] - max(b.z, b.y), 0.f),
+            max(radii[1] - max(b.x, b.y), 0.f),
+            max(radii[2] - max(b.x, b.w), 0.f),
+            max(radii[3] - max(b.z, b.w), 0.f),
+        };
+        add_round_rect(canvas, ix0, iy0, ix1, iy1, inner);
+    }
+
+    plutovg_canvas_set_fill_rule(canvas, PLUTOVG_FILL_RULE_EVEN_ODD);
+    plutovg_canvas_set_rgba(canvas, border.x, border.y, border.z, border.w);
+    plutovg_canvas_fill(canvas);
+    plutovg_canvas_set_fill_rule(canvas, PLUTOVG_FILL_RULE_NON_ZERO);
+}
+
+// =============================================================================
+// Bands:
+// =============================================================================
+static Void draw_rect (plutovg_canvas_t *canvas, SwJob *job, RectInstance *r, Int *clip) {
+    F32 height = plutovg_surface_get_height(sw_surface);
+    F32 quad[] = { r->top_left.x, height - r->top_left.y, r->bottom_right.x, height - r->bottom_right.y };
+
+    Int box[] = {
+        max(clip[0], cast(Int, floorf(quad[0]))),
+        max(clip[1], cast(Int, floorf(quad[1]))),
+        min(clip[2], cast(Int, ceilf(quad[2]))),
+        min(clip[3], cast(Int, ceilf(quad[3]))),
+    };
+
+    if (box[0] >= box[2] || box[1] >= box[3]) return;
+
+    Bool textured = (r->text_color >> 24) > 0;
+    Bool shadowed = (r->outset_shadow_width > .001f) || (r->inset_shadow_width > .001f);
+
+    if (textured || shadowed) shade_rect(job, r, quad, box);
+    else                      fill_rect(canvas, r, quad);
+}
+
+static TPOOL_FN(draw_band) {
+    SwBand *band = arg;
+    Int width    = plutovg_surface_get_width(sw_surface);
+    Int stride   = plutovg_surface_get_stride(sw_surface);
+    U8 *data     = plutovg_surface_get_data(sw_surface);
+
+    // Each band gets a canvas of its own over its rows.
+    plutovg_surface_t *surface = plutovg_surface_create_for_data(data + band->y0*stride, width, band->y1 - band->y0, stride);
+    plutovg_canvas_t *canvas = plutovg_canvas_create(surface);
+    plutovg_canvas_translate(canvas, 0, -cast(F32, band->y0));
+
+    array_iter (job, &sw_jobs, *) {
+        Int clip[] = {
+            job->clip[0],
+            max(job->clip[1], band->y0),
+            job->clip[0] + job->clip[2],
+            min(job->clip[1] + job->clip[3], band->y1),
+        };
+
+        if (clip[0] >= clip[2] || clip[1] >= clip[3]) continue;
+
+        plutovg_canvas_save(canvas);
+        plutovg_canvas_clip_rect(canvas, clip[0], clip[1], clip[2] - clip[0], clip[3] - clip[1]);
+        for (U32 i = 0; i < job->count; ++i) draw_rect(canvas, job, &job->rects[i], clip);
+        plutovg_canvas_restore(canvas);
+    }
+
+    plutovg_canvas_destroy(canvas);
+    plutovg_surface_destroy(surface);
+}
+
+Void sw_flush () {
+    if (! sw_jobs.count) return;
+
+    // Only the rows that the jobs can touch are split up.
+    Int y0 = INT32_MAX;
+    Int y1 = 0;
+    array_iter (job, &sw_jobs, *) {
+        y0 = min(y0, job->clip[1]);
+        y1 = max(y1, job->clip[1] + job->clip[3]);
+    }
+
+    if (y0 < y1) {
+        tmem_new(tm);
+        SliceRangeU64 ranges = tpool_split(sw_pool, tm, y1 - y0);
+
+        array_iter (range, &ranges, *) {
+            if (range->a == range->b) continue;
+            SwBand *band = mem_new(tm, SwBand);
+            band->y0 = y0 + range->a;
+            band->y1 = y0 + range->b;
+            tpool_push(sw_pool, draw_band, band);
+        }
+
+        tpool_wait(sw_pool);
+    }
+
+    sw_jobs.count = 0;
+}
+
+Void sw_rects (RectInstance *rects, U32 count, U32 *textures, U32 texture_count, Int *clip) {
+    if (!count || clip[2] <= 0 || clip[3] <= 0) return;
+
+    Auto job = array_push_slot(&sw_jobs);
+    job->rects = rects;
+    job->count = count;
+    job->texture_count = min(texture_count, cast(U32, SW_MAX_TEXTURE_SLOTS));
+    memcpy(job->textures, textures, job->texture_count * sizeof(U32));
+    memcpy(job->clip, clip, sizeof(job->clip));
+}
+
+// =============================================================================
+// Blur:
+// -----
+//
+// A box blur run 3 times in each direction, which comes close
+// to a gaussian with a sigma about the size of the radius. The
+// blurred pixels are read from up to 3 times the radius away.
+// =============================================================================
+static Void box_blur_line (U32 *line, Int count, Int step, Int radius, U32 *scratch) {
+    for (Int i = 0; i < count; ++i) scratch[i] = line[i*step];
+
+    U32 sum[4] = {};
+    U32 n = 2*radius + 1;
+
+    for (Int i = -radius; i <= radius; ++i) {
+        U32 p = scratch[clamp(i, 0, count - 1)];
+        for (U32 c = 0; c < 4; ++c) sum[c] += (p >> (8*c)) & 0xff;
+    }
+
+    for (Int i = 0; i < count; ++i) {
+        U32 p = 0;
+        for (U32 c = 0; c < 4; ++c) p |= ((sum[c] + n/2) / n) << (8*c);
+        line[i*step] = p;
+
+        U32 out = scratch[clamp(i - radius, 0, count - 1)];
+        U32 in  = scratch[clamp(i + radius + 1, 0, count - 1)];
+        for (U32 c = 0; c < 4; ++c) sum[c] += ((in >> (8*c)) & 0xff) - ((out >> (8*c)) & 0xff);
+    }
+}
+
+Void sw_blur (Rect rect, U32 radius, Vec4 corner_radius, Int *clip) {
+    sw_flush();
+
+    Int width  = plutovg_surface_get_width(sw_surface);
+    Int height = plutovg_surface_get_height(sw_surface);
+    Int stride = plutovg_surface_get_stride(sw_surface) / 4;
+    U32 *pixels = cast(U32*, plutovg_surface_get_data(sw_surface));
+
+    Int box[] = {
+        max(clip[0], cast(Int, floorf(rect.x))),
+        max(clip[1], cast(Int, floorf(rect.y))),
+        min(clip[0] + clip[2], cast(Int, ceilf(rect.x + rect.w))),
+        min(clip[1] + clip[3], cast(Int, ceilf(rect.y + rect.h))),
+    };
+
+    if (box[0] >= box[2] || box[1] >= box[3]) return;
+
+    Int reach  = 3 * radius;
+    Int area[] = { max(0, box[0] - reach), max(0, box[1] - reach), min(width, box[2] + reach), min(height, box[3] + reach) };
+    Int w      = area[2] - area[0];
+    Int h      = area[3] - area[1];
+
+    tmem_new(tm);
+    U32 *buf = mem_alloc(tm, U32, .size=(w * h * sizeof(U32)));
+    U32 *scratch = mem_alloc(tm, U32, .size=(max(w, h) * sizeof(U32)));
+    for (Int y = 0; y < h; ++y) memcpy(buf + y*w, pixels + (area[1] + y)*stride + area[0], w * sizeof(U32));
+
+    for (U32 i = 0; i < 3; ++i) {
+        for (Int y = 0; y < h; ++y) box_blur_line(buf + y*w, w, 1, radius, scratch);
+        for (Int x = 0; x < w; ++x) box_blur_line(buf + x, h, w, radius, scratch);
+    }
+
+    F32 cx = rect.x + rect.w/2;
+    F32 cy = rect.y + rect.h/2;
+
+    for (Int y = box[1]; y < box[3]; ++y) {
+        for (Int x = box[0]; x < box[2]; ++x) {
+            F32 px = x + .5f - cx;
+            F32 py = y + .5f - cy;
+            if (rect_sdf(px, py, rect.w/2, rect.h/2, select_radius(px, py, corner_radius)) > 0) continue;
+            pixels[y*stride + x] = buf[(y - area[1])*w + (x - area[0])] | 0xff000000;
+        }
+    }
+}
+
+// =============================================================================
+// Targets:
+// =============================================================================
+U32 sw_texture_new (U32 width, U32 height) {
+    plutovg_surface_t *surface = plutovg_surface_create(width, height);
+
+    if (sw_free_textures.count) {
+        U32 id = array_pop(&sw_free_textures);
+        array_set(&sw_textures, id - 1, surface);
+        return id;
+    }
+
+    array_push(&sw_textures, surface);
+    return sw_textures.count;
+}
+
+Void sw_texture_update (U32 texture, U32 x, U32 y, U32 w, U32 h, U8 *rgba) {
+    sw_flush();
+
+    plutovg_surface_t *surface = array_get(&sw_textures, texture - 1);
+    assert_dbg(x + w <= cast(U32, plutovg_surface_get_width(surface)));
+    assert_dbg(y + h <= cast(U32, plutovg_surface_get_height(surface)));
+
+    Int stride = plutovg_surface_get_stride(surface);
+    U8 *data = plutovg_surface_get_data(surface);
+    for (U32 row = 0; row < h; ++row) plutovg_convert_rgba_to_argb(data + (y + row)*stride + 4*x, rgba + 4*w*row, w, 1, 4*w);
+}
+
+// The id goes on the free list, so like a GL texture name it can
+// be handed out again by the next sw_texture_new().
+Void sw_texture_free (U32 texture) {
+    sw_flush();
+    plutovg_surface_destroy(array_get(&sw_textures, texture - 1));
+    array_set(&sw_textures, texture - 1, 0);
+    array_push(&sw_free_textures, texture);
+}
+
+Void sw_clear (Int *clip) {
+    sw_flush();
+
+    Int stride = plutovg_surface_get_stride(sw_surface) / 4;
+    U32 *pixels = cast(U32*, plutovg_surface_get_data(sw_surface));
+
+    for (Int y = clip[1]; y < clip[1] + clip[3]; ++y) {
+        for (Int x = clip[0]; x < clip[0] + clip[2]; ++x) pixels[y*stride + x] = 0xff000000;
+    }
+}
+
+U8 *sw_get_pixels (U32 *out_stride) {
+    *out_stride = plutovg_surface_get_stride(sw_surface);
+    return plutovg_surface_get_data(sw_surface);
+}
+
+Void sw_resize (U32 width, U32 height) {
+    sw_flush();
+
+    if (sw_surface) {
+        Bool same = (cast(U32, plutovg_surface_get_width(sw_surface)) == width) && (cast(U32, plutovg_surface_get_height(sw_surface)) == height);
+        if (same) return;
+        plutovg_surface_destroy(sw_surface);
+    }
+
+    sw_surface = plutovg_surface_create(max(1u, width), max(1u, height));
+}
+
+Void sw_init (U64 thread_count) {
+    sw_pool = tpool_new(mem_root, clamp(thread_count, 1ul, cast(U64, SW_MAX_THREADS)), 2*SW_MAX_THREADS);
+    array_init(&sw_textures, mem_root);
+    array_init(&sw_free_textures, mem_root);
+    array_init(&sw_jobs, mem_root);
+}
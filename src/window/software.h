@@ -0,0 +1,35 @@
+#pragma once
+
+// =============================================================================
+// Overview:
+// ---------
+//
+// A CPU rasterizer that the window module replays the frame on
+// when it was started with DR_BACKEND_SOFTWARE. It draws into a
+// plutovg surface that has the size of the window.
+//
+// Rects are not drawn right away. They are queued up until the
+// next sw_flush() which splits the window into horizontal bands
+// and fills the bands on a thread pool. Operations that read or
+// write pixels outside of a band (blurs, texture updates and
+// clears) flush the queue first.
+//
+// Clip rects are given as x, y, w, h in window coordinates. The
+// rect instances are the ones from the ring buffer, so they are
+// in GL coordinates and stay alive until the end of the frame.
+// =============================================================================
+#include "base/core.h"
+#include "window/window.h"
+
+#define SW_MAX_TEXTURE_SLOTS 8 // Must match MAX_TEXTURE_UNITS in window.c.
+
+Void sw_init           (U64 thread_count);
+Void sw_resize         (U32 width, U32 height);
+U32  sw_texture_new    (U32 width, U32 height);
+Void sw_texture_update (U32 texture, U32 x, U32 y, U32 w, U32 h, U8 *rgba);
+Void sw_texture_free   (U32 texture);
+Void sw_clear          (Int *clip);
+Void sw_rects          (RectInstance *, U32 count, U32 *textures, U32 texture_count, Int *clip);
+Void sw_blur           (Rect, U32 radius, Vec4 corner_radius, Int *clip);
+Void sw_flush          ();
+U8  *sw_get_pixels     (U32 *out_stride); // Premultiplied ARGB32.
@@ -1,347 +1,2420 @@
 #include "vendor/glad/glad.h"
 #include <SDL3/SDL.h>
+#include <inttypes.h>
 #include "vendor/stb/stb_image.h"
+#include "vendor/stb/stb_image_write.h"
+#include "os/info.h"
+#include "os/threads.h"
+#include "base/tpool.h"
 #include "window/window.h"
+#include "window/software.h"
 #include "ui/ui.h"
 
-#define VERTEX_MAX_BATCH_SIZE 2400
+// Instances are streamed through a buffer that is mapped
+// persistently and split into RING_REGIONS regions. A frame
+// writes into one region while the GPU may still be reading the
+// previous ones. When we leave a region we put a fence after it,
+// and before entering a region we wait for its fence. A frame
+// has to fit into one region, so if it doesn't the buffer gets
+// replaced with one that has regions twice as big.
+#define RING_REGIONS         3
+#define RING_REGION_CAPACITY (4*MB) // Initial, in bytes.
+
+// Size of the vertex format that used 6 vertices per rect. It
+// is only used to report how much upload instancing saves.
+#define FAT_VERTEX_SIZE (42*sizeof(F32))
+
+#define MAX_UNIFORMS      16
+#define MAX_TEXTURE_UNITS 8
+
+#define RENDER_TARGET_POOL_SIZE 32
+#define RENDER_TARGET_BUCKET    128 // Target sizes are rounded up to a multiple of this.
+#define RENDER_TARGET_MAX_AGE   120 // Presented frames a free target is kept around for.
+
+istruct (Uniform) {
+    CString name;
+    Int location;
+    Bool has_value;
+    U8 value[sizeof(Mat4)];
+};
+
+istruct (Shader) {
+    U32 id;
+    U32 uniform_count;
+    Uniform uniforms[MAX_UNIFORMS];
+};
+
+istruct (GlState) {
+    U32 program;
+    U32 vao;
+    U32 draw_framebuffer;
+    U32 read_framebuffer;
+    U32 textures[MAX_TEXTURE_UNITS];
+    Int scissor[4];
+    Int viewport[4];
+};
+
+GlState gl_state;
+
+istruct (RenderTarget) {
+    U32 fbo; // 0 if the slot is empty.
+    U32 texture;
+    U32 width; // Allocated size which can be bigger than the used one.
+    U32 height;
+    Bool in_use;
+    U64 last_used; // Value of frames_presented.
+};
+
+RenderTarget render_targets[RENDER_TARGET_POOL_SIZE];
+Bool resize_pending;
+
+SDL_Window *window;
+SDL_GLContext gl_ctx;
+Bool software; // Replay frames with the rasterizer in software.c instead of GL.
+ArrayEvent events;
+
+Int win_width  = 1000;
+Int win_height = 600;
+
+SDL_Cursor *cursors[SDL_SYSTEM_CURSOR_COUNT];
+U32 wake_event; // Pushed by win_wake().
+
+#define BLUR_MAX_LEVELS 6
+Shader blur_shader;
+U32 blur_VBO, blur_VAO;
+RenderTarget *blur_targets[BLUR_MAX_LEVELS + 1]; // Level i is 1/2^i of the window. Level 0 is unused.
+Array(struct { Vec2 pos; }) blur_vertices;
+
+ienum (BlurPass, U8) {
+    BLUR_DOWNSAMPLE,
+    BLUR_UPSAMPLE,
+    BLUR_DRAW,
+};
+
+// The area last blurred into the blur buffers. See blur().
+istruct (BlurCapture) {
+    Bool valid;
+    U32 levels;
+    Rect area;  // In window coordinates.
+    Rect dirty; // Bounding box of rects drawn since the capture.
+};
+
+BlurCapture blur_capture;
+
+// Both instance formats go into the same buffer. A batch starts
+// at a multiple of its instance size, so the start can be given
+// to the draw call as the base instance.
+istruct (RingBuffer) {
+    U32 id;
+    U8 *data; // Persistently mapped.
+    U32 capacity; // Of a region, in bytes.
+    U32 region;
+    U32 count; // Bytes written into the current region.
+    GLsync fences[RING_REGIONS];
+};
+
+RingBuffer ring;
+DrFrameStats frame_stats;
+DrFrameStats last_frame_stats;
+
+// Glyphs are drawn with a program and an instance format of
+// their own. The rect shader is compiled into a few programs
+// that each skip the parts of the fragment shader that a kind
+// of rect doesn't need. Without a GPU the SDF math for the
+// decorations that most rects don't have is most of the cost
+// of drawing them.
+ienum (DrPipeline, U8) {
+    DR_PIPELINE_GLYPHS,   // GlyphInstance.
+    DR_PIPELINE_TEXTURED, // RectInstance that is textured without decorations.
+    DR_PIPELINE_FLAT,     // Solid or gradient, sharp corners.
+    DR_PIPELINE_ROUNDED,  // Rounded corners and borders.
+    DR_PIPELINE_FULL,     // Anything else, shadows in particular.
+    DR_PIPELINE_COUNT
+};
+
+ienum (DrCmdTag, U8) {
+    DR_CMD_RECTS,
+    DR_CMD_SCISSOR,
+    DR_CMD_BLUR,
+    DR_CMD_TEXTURE_UPDATE,
+};
+
+istruct (DrCmd) {
+    DrCmdTag tag;
+    CString label; // See dr_label(). Only set while profiling.
+
+    union {
+        struct {
+            U32 first; // Into the instances of the recorder until sort_cmds(), then into the ring.
+            U32 count;
+            DrPipeline pipeline;
+            U32 texture_count;
+            U32 textures[MAX_TEXTURE_UNITS];
+            Rect bounds; // In window coordinates.
+        } rects;
+
+        Rect scissor; // In GL coordinates.
+
+        struct {
+            Rect rect;
+            F32 strength;
+            Vec4 corner_radius;
+        } blur;
+
+        struct {
+            U32 texture;
+            U32 x, y, w, h;
+            U8 *buf; // Copy of the pixels in the mem of the recorder.
+        } texture_update;
+    };
+};
+
+array_typedef(DrCmd, DrCmd);
+
+// Everything the dr_* functions record during a frame. The main
+// thread records into main_recorder which is what gets reordered
+// by sort_cmds() and replayed by submit_frame() at the end of the
+// frame. Other threads can record parts of the frame into their
+// own recorders which are then spliced in. See dr_record_begin().
+istruct (DrRecorder) {
+    ArrayDrCmd cmds;
+    Mem *mem; // For the texture update copies. Freed at the end of each frame.
+
+    // The instances in the order they were recorded. They are
+    // copied into the ring in the order they end up drawn in.
+    ArrayRectInstance rects;
+    ArrayGlyphInstance glyphs;
+    U32 rects_flushed; // Instances already in a DR_CMD_RECTS.
+    U32 glyphs_flushed;
+
+    // Hash of everything recorded. If the one of the main recorder
+    // matches the hash of the previous frame, the frame isn't
+    // submitted or presented at all.
+    U64 hash;
+
+    // See dr_hash_begin().
+    Bool hash_span_active;
+    U64  hash_span;
+    F32  hash_span_bounds[4]; // x0, y0, x1, y1 in window coordinates.
+
+    // Textures used by the rects of the current batch. Each rect
+    // carries the index of its texture in this table, so switching
+    // between font atlases and images doesn't end the batch.
+    U32 texture_slots[MAX_TEXTURE_UNITS];
+    U32 texture_slot_count;
+    F32 batch_bounds[4];
+    U32 bound_texture;      // Set by dr_bind_texture().
+    Int bound_texture_slot; // -1 if not looked up yet.
+    DrPipeline batch_pipeline;
+    CString label; // Copy in mem. See dr_label().
+};
+
+DrRecorder main_recorder;
+tls DrRecorder *recorder = &main_recorder;
+ArrayDrCmd sorted_cmds;
+Bool dump_cmds; // See dr_dump_cmds().
+
+// The offscreen framebuffer is retained between frames and only
+// the damaged area gets cleared and redrawn. See dr_set_damage.
+Bool damage_was_set;
+Bool damage_everything = true; // Set when the framebuffer is recreated.
+Rect damage;
+
+U64  last_frame_hash;
+Bool present_needed = true; // Set when the window contents are lost.
+U64  frames_presented;
+U64  frames_skipped;
+
+Shader pipeline_shaders[DR_PIPELINE_COUNT];
+U32 VAO;
+U32 glyph_VAO;
+U32 quad_VBO;
+Array(struct { Vec2 corner; }) quad_vertices;
+Mat4 projection;
+RenderTarget *frame_target; // Retained between frames.
+
+Shader screen_shader;
+U32 screen_VBO, screen_VAO;
+Array(struct { Vec2 pos; Vec2 tex; }) screen_vertices;
+
+#define ATTR(VAO, BINDING, T, OFFSET, LEN, NAME) ({\
+    glVertexArrayAttribFormat(VAO, OFFSET, LEN, GL_FLOAT, GL_FALSE, offsetof(T, NAME));\
+    glVertexArrayAttribBinding(VAO, OFFSET, BINDING);\
+    glEnableVertexArrayAttrib(VAO, OFFSET);\
+})
+
+#define ATTR_U32(VAO, BINDING, T, OFFSET, LEN, NAME) ({\
+    glVertexArrayAttribIFormat(VAO, OFFSET, LEN, GL_UNSIGNED_INT, offsetof(T, NAME));\
+    glVertexArrayAttribBinding(VAO, OFFSET, BINDING);\
+    glEnableVertexArrayAttrib(VAO, OFFSET);\
+})
+
+#define ATTR_U16(VAO, BINDING, T, OFFSET, LEN, NAME) ({\
+    glVertexArrayAttribIFormat(VAO, OFFSET, LEN, GL_UNSIGNED_SHORT, offsetof(T, NAME));\
+    glVertexArrayAttribBinding(VAO, OFFSET, BINDING);\
+    glEnableVertexArrayAttrib(VAO, OFFSET);\
+})
+
+Noreturn static Void error () {
+    log_scope_end_all();
+    panic();
+}
+
+Noreturn Fmt(1, 2) static Void error_fmt (CString fmt, ...) {
+    log_msg(m, LOG_ERROR, "Win", 1);
+    astr_push_fmt_vam(m, fmt);
+    astr_push_byte(m, '\n');
+    error();
+}
+
+static Void update_projection () {
+    F32 h = cast(F32, win_height);
+    F32 w = cast(F32, win_width);
+    projection = mat_ortho(0, w, 0, h, -1.f, 1.f);
+}
+
+// =============================================================================
+// GL state cache:
+// ---------------
+//
+// Binds, scissor and viewport changes and uniform uploads go
+// through the gl_* and set_* functions below. They remember
+// what the GL state currently is and skip calls that would not
+// change it. Uniform locations are looked up once per program
+// and cached in the Shader struct together with the last value.
+//
+// Resources are created and updated with the DSA functions so
+// that doing so doesn't disturb the bind points.
+// =============================================================================
+static Bool gl_state_changed (Bool changed) {
+    if (changed) frame_stats.gl_calls_issued++;
+    else         frame_stats.gl_calls_elided++;
+    return changed;
+}
+
+static Void gl_use_program (Shader *shader) {
+    if (! gl_state_changed(gl_state.program != shader->id)) return;
+    gl_state.program = shader->id;
+    glUseProgram(shader->id);
+}
+
+static Void gl_bind_vao (U32 vao) {
+    if (! gl_state_changed(gl_state.vao != vao)) return;
+    gl_state.vao = vao;
+    glBindVertexArray(vao);
+}
+
+static Void gl_bind_framebuffer (GLenum target, U32 fbo) {
+    Bool draw = (target != GL_READ_FRAMEBUFFER);
+    Bool read = (target != GL_DRAW_FRAMEBUFFER);
+    Bool changed = (draw && gl_state.draw_framebuffer != fbo) || (read && gl_state.read_framebuffer != fbo);
+    if (! gl_state_changed(changed)) return;
+    if (draw) gl_state.draw_framebuffer = fbo;
+    if (read) gl_state.read_framebuffer = fbo;
+    glBindFramebuffer(target, fbo);
+}
+
+static Void gl_bind_texture (U32 unit, U32 texture) {
+    assert_dbg(unit < MAX_TEXTURE_UNITS);
+    if (! gl_state_changed(gl_state.textures[unit] != texture)) return;
+    gl_state.textures[unit] = texture;
+    glBindTextureUnit(unit, texture);
+}
+
+// Deleting a bound object unbinds it, and the name can be handed
+// out again by the next glCreate*, so the cache must forget it or
+// a later bind of the new object would be skipped.
+static Void gl_delete_texture (U32 texture) {
+    glDeleteTextures(1, &texture);
+    for (U32 i = 0; i < MAX_TEXTURE_UNITS; ++i) if (gl_state.textures[i] == texture) gl_state.textures[i] = 0;
+}
+
+static Void gl_delete_framebuffer (U32 fbo) {
+    glDeleteFramebuffers(1, &fbo);
+    if (gl_state.draw_framebuffer == fbo) gl_state.draw_framebuffer = 0;
+    if (gl_state.read_framebuffer == fbo) gl_state.read_framebuffer = 0;
+}
+
+static Void gl_scissor (Int x, Int y, Int w, Int h) {
+    Int *r = gl_state.scissor;
+    if (! gl_state_changed(r[0] != x || r[1] != y || r[2] != w || r[3] != h)) return;
+    r[0] = x; r[1] = y; r[2] = w; r[3] = h;
+    glScissor(x, y, w, h);
+}
+
+static Void gl_viewport (Int x, Int y, Int w, Int h) {
+    Int *r = gl_state.viewport;
+    if (! gl_state_changed(r[0] != x || r[1] != y || r[2] != w || r[3] != h)) return;
+    r[0] = x; r[1] = y; r[2] = w; r[3] = h;
+    glViewport(x, y, w, h);
+}
+
+// Returns false if the uniform already holds the given value.
+static Bool uniform_changed (Shader *shader, CString name, Void *value, U64 size, Int *out_location) {
+    assert_dbg(size <= sizeof(Mat4));
+
+    Uniform *u = 0;
+    for (U32 i = 0; i < shader->uniform_count; ++i) {
+        Uniform *it = &shader->uniforms[i];
+        if (it->name == name || cstr_match(it->name, name)) { u = it; break; }
+    }
+
+    if (! u) {
+        assert_always(shader->uniform_count < MAX_UNIFORMS);
+        u = &shader->uniforms[shader->uniform_count++];
+        u->name = name;
+        u->location = glGetUniformLocation(shader->id, name);
+    }
+
+    Bool changed = !u->has_value || memcmp(u->value, value, size);
+    if (! gl_state_changed(changed)) return false;
+
+    u->has_value = true;
+    memcpy(u->value, value, size);
+    *out_location = u->location;
+    return true;
+}
+
+static Void set_bool  (Shader *s, CString name, Bool v) { Int l; if (uniform_changed(s, name, &v, sizeof(v), &l)) glProgramUniform1i(s->id, l, cast(Int, v)); }
+static Void set_int   (Shader *s, CString name, Int v)  { Int l; if (uniform_changed(s, name, &v, sizeof(v), &l)) glProgramUniform1i(s->id, l, v); }
+static Void set_float (Shader *s, CString name, F32 v)  { Int l; if (uniform_changed(s, name, &v, sizeof(v), &l)) glProgramUniform1f(s->id, l, v); }
+static Void set_vec2  (Shader *s, CString name, Vec2 v) { Int l; if (uniform_changed(s, name, &v, sizeof(v), &l)) glProgramUniform2f(s->id, l, v.x, v.y); }
+static Void set_vec4  (Shader *s, CString name, Vec4 v) { Int l; if (uniform_changed(s, name, &v, sizeof(v), &l)) glProgramUniform4f(s->id, l, v.x, v.y, v.z, v.w); }
+static Void set_mat4  (Shader *s, CString name, Mat4 m) { Int l; if (uniform_changed(s, name, &m, sizeof(m), &l)) glProgramUniformMatrix4fv(s->id, l, 1, GL_FALSE, cast(F32*, &m)); }
+
+static U32 framebuffer_new (U32 *out_texture, Bool only_color_attach, U32 w, U32 h) {
+    U32 r;
+    glCreateFramebuffers(1, &r);
+
+    U32 texture;
+    glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+    glTextureStorage2D(texture, 1, GL_RGB8, w, h);
+    glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glNamedFramebufferTexture(r, GL_COLOR_ATTACHMENT0, texture, 0);
+    if (out_texture) *out_texture = texture;
+
+    if (! only_color_attach) {
+        U32 rbo;
+        glCreateRenderbuffers(1, &rbo);
+        glNamedRenderbufferStorage(rbo, GL_DEPTH24_STENCIL8, w, h);
+        glNamedFramebufferRenderbuffer(r, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo);
+    }
+
+    assert_always(glCheckNamedFramebufferStatus(r, GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+    return r;
+}
+
+// =============================================================================
+// Render target pool:
+// -------------------
+//
+// Offscreen targets are allocated with their size rounded up to
+// a bucket so that small changes of the window size reuse them.
+// Released targets stay in the pool for a while in case they are
+// wanted again, which happens when resizing back and forth. What
+// is drawn into a target only covers the bottom left part of it
+// that is in use, so sampling has to scale uv's accordingly.
+// =============================================================================
+static U32 render_target_bucket (U32 size) {
+    return max(1u, (size + RENDER_TARGET_BUCKET - 1) / RENDER_TARGET_BUCKET) * RENDER_TARGET_BUCKET;
+}
+
+static Bool render_target_fits (RenderTarget *target, U32 width, U32 height) {
+    return target && (target->width == render_target_bucket(width)) && (target->height == render_target_bucket(height));
+}
+
+static Void render_target_delete (RenderTarget *target) {
+    gl_delete_framebuffer(target->fbo);
+    gl_delete_texture(target->texture);
+    frame_stats.render_target_bytes -= 4 * target->width * target->height;
+    *target = (RenderTarget){};
+}
+
+static RenderTarget *render_target_acquire (U32 width, U32 height) {
+    U32 w = render_target_bucket(width);
+    U32 h = render_target_bucket(height);
+    RenderTarget *empty = 0;
+    RenderTarget *oldest = 0;
+
+    for (U32 i = 0; i < RENDER_TARGET_POOL_SIZE; ++i) {
+        RenderTarget *t = &render_targets[i];
+
+        if (! t->fbo) {
+            if (! empty) empty = t;
+        } else if (! t->in_use) {
+            if (t->width == w && t->height == h) { t->in_use = true; return t; }
+            if (!oldest || t->last_used < oldest->last_used) oldest = t;
+        }
+    }
+
+    if (! empty) {
+        if (! oldest) error_fmt("Ran out of render targets.");
+        render_target_delete(oldest);
+        empty = oldest;
+    }
+
+    empty->fbo = framebuffer_new(&empty->texture, 1, w, h);
+    empty->width = w;
+    empty->height = h;
+    empty->in_use = true;
+    frame_stats.render_target_bytes += 4 * w * h;
+    frame_stats.render_target_allocs++;
+    return empty;
+}
+
+static Void render_target_release (RenderTarget *target) {
+    if (! target) return;
+    target->in_use = false;
+    target->last_used = frames_presented;
+}
+
+static Void render_target_trim () {
+    for (U32 i = 0; i < RENDER_TARGET_POOL_SIZE; ++i) {
+        RenderTarget *t = &render_targets[i];
+        if (t->fbo && !t->in_use && (frames_presented - t->last_used > RENDER_TARGET_MAX_AGE)) render_target_delete(t);
+    }
+}
+
+// Resize events only record the new size. The targets are swapped
+// out here once per presented frame, so a burst of resize events
+// results in a single reallocation.
+static Void update_render_targets () {
+    if (! resize_pending) return;
+    resize_pending = false;
+
+    if (software) {
+        sw_resize(win_width, win_height);
+        damage_everything = true;
+        return;
+    }
+
+    if (! render_target_fits(frame_target, win_width, win_height)) {
+        render_target_release(frame_target);
+        frame_target = render_target_acquire(win_width, win_height);
+    }
+
+    for (U32 i = 1; i <= BLUR_MAX_LEVELS; ++i) {
+        U32 w = max(1, win_width >> i);
+        U32 h = max(1, win_height >> i);
+        if (render_target_fits(blur_targets[i], w, h)) continue;
+        render_target_release(blur_targets[i]);
+        blur_targets[i] = render_target_acquire(w, h);
+    }
+
+    blur_capture.valid = false;
+    damage_everything = true;
+}
+
+// =============================================================================
+// Program cache:
+// --------------
+//
+// Linked programs are saved with glGetProgramBinary() into the
+// pref directory and loaded with glProgramBinary() on the next
+// start, which skips compiling and linking. The file name is a
+// hash of the sources, the defines and the GL vendor, renderer
+// and version strings, so editing a shader or updating the driver
+// makes the old binary unreachable. A driver can still refuse a
+// binary, in which case the program is compiled from source and
+// the cache file gets replaced.
+//
+// Once all programs are created, every file in the directory that
+// isn't named after a key used in this run is deleted, so binaries
+// of old shader versions and drivers don't pile up.
+// =============================================================================
+#define PROGRAM_CACHE_MAGIC 0x4d494d50 // "MIMP"
+
+istruct (ProgramCacheHeader) {
+    U32 magic;
+    U32 format;
+    U64 key;
+};
+
+istruct (ProgramCacheStats) {
+    U32 loaded;
+    U32 compiled;
+    U64 load_time; // In performance counter ticks.
+    U64 compile_time;
+};
+
+static String program_cache_dir; // Empty if the cache is disabled.
+static U64 program_cache_driver_hash;
+static ProgramCacheStats program_cache_stats;
+static Array(U64) program_cache_keys;
+
+static Void program_cache_init () {
+    Int format_count = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+    if (format_count == 0) return;
+
+    Char *pref_path = SDL_GetPrefPath("mimui", "mimui");
+    if (! pref_path) return;
+    String dir = astr_fmt(mem_root, "%sshader_cache", pref_path);
+    SDL_free(pref_path);
+
+    if (!fs_dir_exists(dir) && !fs_make_dir(dir)) return;
+
+    U64 hash = 0;
+    hash = str_hash_seed(str(cast(CString, glGetString(GL_VENDOR))), hash);
+    hash = str_hash_seed(str(cast(CString, glGetString(GL_RENDERER))), hash);
+    hash = str_hash_seed(str(cast(CString, glGetString(GL_VERSION))), hash);
+
+    program_cache_dir = dir;
+    program_cache_driver_hash = hash;
+    array_init(&program_cache_keys, mem_root);
+}
+
+static String program_cache_path (Mem *mem, U64 key) {
+    return astr_fmt(mem, "%.*s/%016" PRIx64 ".bin", STR(program_cache_dir), key);
+}
+
+static Bool program_cache_load (U32 program, U64 key) {
+    if (! program_cache_dir.count) return false;
+    array_push(&program_cache_keys, key);
+
+    tmem_new(tm);
+    String data = fs_read_entire_file(tm, program_cache_path(tm, key), 0);
+    if (data.count <= sizeof(ProgramCacheHeader)) return false;
+
+    ProgramCacheHeader header;
+    memcpy(&header, data.data, sizeof(header));
+    if (header.magic != PROGRAM_CACHE_MAGIC || header.key != key) return false;
+
+    glProgramBinary(program, header.format, data.data + sizeof(header), cast(Int, data.count - sizeof(header)));
+
+    Int success; glGetProgramiv(program, GL_LINK_STATUS, &success);
+    return success;
+}
+
+static Void program_cache_store (U32 program, U64 key) {
+    if (! program_cache_dir.count) return;
+
+    Int size = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+    if (size <= 0) return;
+
+    tmem_new(tm);
+    U64 total = sizeof(ProgramCacheHeader) + cast(U64, size);
+    Char *data = mem_alloc(tm, Char, .size=total);
+    ProgramCacheHeader header = { .magic=PROGRAM_CACHE_MAGIC, .key=key };
+    glGetProgramBinary(program, size, 0, &header.format, data + sizeof(header));
+    memcpy(data, &header, sizeof(header));
+
+    // Written to a temporary first so that a crash can't leave a
+    // truncated binary behind under the real name.
+    String path = program_cache_path(tm, key);
+    String tmp_path = astr_fmt(tm, "%.*s.tmp", STR(path));
+    if (fs_write_entire_file(tmp_path, (String){ .data=data, .count=total })) fs_move(tmp_path, path);
+}
+
+static Void program_cache_prune () {
+    if (! program_cache_dir.count) return;
+
+    tmem_new(tm);
+    ArrayString stale;
+    array_init(&stale, tm);
+
+    FsIter *it = fs_iter_new(tm, program_cache_dir, true, false);
+    while (fs_iter_next(it)) {
+        Bool used = false;
+        array_iter (key, &program_cache_keys) {
+            String name = astr_fmt(tm, "%016" PRIx64 ".bin", key);
+            if (str_match(name, it->current_file_name)) { used = true; break; }
+        }
+        if (! used) array_push(&stale, astr_fmt(tm, "%.*s", STR(it->current_full_path)));
+    }
+    fs_iter_destroy(it);
+
+    // Deleted after the walk since removing entries from a directory
+    // that is being read may skip some of them.
+    array_iter (path, &stale) fs_delete(path);
+}
+
+static Void program_cache_log () {
+    ProgramCacheStats *s = &program_cache_stats;
+    F64 freq = cast(F64, SDL_GetPerformanceFrequency());
+
+    log_msg(m, LOG_NOTE, "Win", 1);
+    astr_push_fmt(m, "Shader programs: %u loaded from cache in %.2fms, %u compiled in %.2fms.\n",
+                  s->loaded, 1000.0 * s->load_time / freq, s->compiled, 1000.0 * s->compile_time / freq);
+}
+
+// The defines are inserted right after the #version line which
+// has to be the first line of the file.
+static U32 shader_compile (GLenum type, String filepath, String source, CString defines) {
+    Char *body = memchr(source.data, '\n', source.count);
+    if (! body) error_fmt("Missing #version line: %.*s\n", STR(filepath));
+    body++;
+
+    const GLchar *strings[] = { source.data, defines, body };
+    Int lengths[] = { cast(Int, body - source.data), -1, cast(Int, source.count - (body - source.data)) };
+
+    U32 shader = glCreateShader(type);
+
+    glShaderSource(shader, 3, strings, lengths);
+    glCompileShader(shader);
+
+    Int success; glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (! success) {
+        log_msg(msg, LOG_ERROR, "", 1);
+        Int count; glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &count);
+        astr_push_fmt(msg, "Shader compilation error: %.*s\n  ", STR(filepath));
+        U32 offset = msg->count;
+        array_increase_count(msg, cast(U32, count), false);
+        glGetShaderInfoLog(shader, count, 0, msg->data + offset);
+        msg->count--; // Get rid of the NUL byte...
+        error();
+    }
+
+    return shader;
+}
+
+static String shader_read (Mem *mem, CString filepath) {
+    String source = fs_read_entire_file(mem, str(filepath), 0);
+    if (! source.data) error_fmt("Unable to read file: %s\n", filepath);
+    return source;
+}
+
+static U32 shader_new (CString vshader_path, CString fshader_path, CString defines) {
+    tmem_new(tm);
+
+    U64 start      = SDL_GetPerformanceCounter();
+    String vsource = shader_read(tm, vshader_path);
+    String fsource = shader_read(tm, fshader_path);
+
+    U64 key = program_cache_driver_hash;
+    key = str_hash_seed(vsource, key);
+    key = str_hash_seed(fsource, key);
+    key = str_hash_seed(str(defines), key);
+
+    U32 id = glCreateProgram();
+
+    if (program_cache_load(id, key)) {
+        program_cache_stats.loaded++;
+        program_cache_stats.load_time += SDL_GetPerformanceCounter() - start;
+        return id;
+    }
+
+    U32 vshader = shader_compile(GL_VERTEX_SHADER, str(vshader_path), vsource, defines);
+    U32 fshader = shader_compile(GL_FRAGMENT_SHADER, str(fshader_path), fsource, defines);
+
+    glAttachShader(id, vshader);
+    glAttachShader(id, fshader);
+    glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(id);
+
+    Int success; glGetProgramiv(id, GL_LINK_STATUS, &success);
+    if (! success) {
+        log_msg(msg, LOG_ERROR, "", 1);
+        Int count; glGetProgramiv(id, GL_INFO_LOG_LENGTH, &count);
+        astr_push_cstr(msg, "Shader prog link error.\n  ");
+        U32 offset = msg->count;
+        array_increase_count(msg, cast(U32, count), false);
+        glGetProgramInfoLog(id, count, 0, msg->data + offset);
+        msg->count--; // Get rid of the NUL byte...
+        error();
+    }
+
+    glDeleteShader(vshader);
+    glDeleteShader(fshader);
+
+    program_cache_stats.compiled++;
+    program_cache_stats.compile_time += SDL_GetPerformanceCounter() - start;
+    program_cache_store(id, key);
+
+    return id;
+}
+
+// With the software backend the ring is plain memory that only
+// ever uses its first region.
+static Void ring_init (U32 capacity) {
+    U64 size = RING_REGIONS * cast(U64, capacity);
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    ring = (RingBuffer){ .capacity=capacity };
+
+    if (software) {
+        ring.data = mem_alloc(mem_root, U8, .size=capacity);
+        return;
+    }
+
+    glCreateBuffers(1, &ring.id);
+    glNamedBufferStorage(ring.id, size, 0, flags);
+    ring.data = glMapNamedBufferRange(ring.id, 0, size, flags);
+    if (! ring.data) error_fmt("Unable to map the vertex ring buffer.");
+}
+
+// Only called before anything was written into the region, so
+// nothing has to be copied over. The GPU might still be reading
+// the old buffer, but GL keeps it alive until it's done with it.
+static Void ring_grow () {
+    RingBuffer old = ring;
+    ring_init(2 * old.capacity);
+
+    if (software) {
+        mem_free(mem_root, .old_ptr=old.data, .old_size=old.capacity);
+        return;
+    }
+
+    for (U32 i = 0; i < RING_REGIONS; ++i) if (old.fences[i]) glDeleteSync(old.fences[i]);
+    glUnmapNamedBuffer(old.id);
+    glDeleteBuffers(1, &old.id);
+    glVertexArrayVertexBuffer(VAO, 1, ring.id, 0, sizeof(RectInstance));
+    glVertexArrayVertexBuffer(glyph_VAO, 1, ring.id, 0, sizeof(GlyphInstance));
+}
+
+static Void ring_next_region () {
+    if (software) {
+        ring.count = 0;
+        return;
+    }
+
+    ring.fences[ring.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ring.region = (ring.region + 1) % RING_REGIONS;
+    ring.count  = 0;
+
+    GLsync fence = ring.fences[ring.region];
+    if (! fence) return;
+
+    while (true) {
+        GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        if (status != GL_TIMEOUT_EXPIRED) break;
+    }
+
+    glDeleteSync(fence);
+    ring.fences[ring.region] = 0;
+}
+
+static Void recorder_clear (DrRecorder *r) {
+    r->cmds.count = 0;
+    r->rects.count = 0;
+    r->glyphs.count = 0;
+    r->rects_flushed = 0;
+    r->glyphs_flushed = 0;
+    arena_pop_all(cast(Arena*, r->mem));
+    r->hash = 5381;
+    r->texture_slot_count = 0;
+    r->bound_texture = 0;
+    r->bound_texture_slot = -1;
+    r->label = 0;
+    r->batch_bounds[0] = r->batch_bounds[1] = INFINITY;
+    r->batch_bounds[2] = r->batch_bounds[3] = -INFINITY;
+}
+
+static Void recorder_init (DrRecorder *r, Mem *mem) {
+    array_init(&r->cmds, mem);
+    array_init(&r->rects, mem);
+    array_init(&r->glyphs, mem);
+    r->mem = cast(Mem*, arena_new(mem, 64*KB));
+    recorder_clear(r);
+}
+
+DrRecorder *dr_recorder_new (Mem *mem) {
+    DrRecorder *r = mem_new(mem, DrRecorder);
+    recorder_init(r, mem);
+    return r;
+}
+
+Void dr_record_begin (DrRecorder *r) {
+    assert_dbg(recorder == &main_recorder);
+    recorder_clear(r);
+    recorder = r;
+}
+
+Void dr_record_end () {
+    dr_flush_vertices();
+    recorder = &main_recorder;
+}
+
+// The commands of every recorder are appended in the order they
+// were recorded. Texture updates are only recorded into the main
+// recorder (see dr_2d_texture_update), so nothing in a segment can
+// depend on an update made by another segment.
+Void dr_splice (DrRecorder **recorders, U64 count) {
+    DrRecorder *m = &main_recorder;
+    assert_dbg(recorder == m);
+    dr_flush_vertices();
+
+    for (U64 i = 0; i < count; ++i) {
+        DrRecorder *r = recorders[i];
+        assert_dbg(! r->hash_span_active);
+        assert_dbg(r->rects_flushed == r->rects.count);
+        assert_dbg(r->glyphs_flushed == r->glyphs.count);
+        U32 rects_offset = m->rects.count;
+        U32 glyphs_offset = m->glyphs.count;
+
+        array_increase_count(&m->rects, r->rects.count, false);
+        memcpy(&m->rects.data[rects_offset], r->rects.data, r->rects.count * sizeof(RectInstance));
+        array_increase_count(&m->glyphs, r->glyphs.count, false);
+        memcpy(&m->glyphs.data[glyphs_offset], r->glyphs.data, r->glyphs.count * sizeof(GlyphInstance));
+
+        array_iter (cmd, &r->cmds, *) {
+            Auto c = array_push_slot(&m->cmds);
+            *c = *cmd;
+            if (c->tag == DR_CMD_RECTS) c->rects.first += (c->rects.pipeline == DR_PIPELINE_GLYPHS) ? glyphs_offset : rects_offset;
+        }
+
+        m->hash = str_hash_seed((String){ .data=cast(Char*, &r->hash), .count=sizeof(r->hash) }, m->hash);
+    }
+
+    m->rects_flushed = m->rects.count;
+    m->glyphs_flushed = m->glyphs.count;
+}
+
+static U32 instance_size (DrPipeline pipeline) {
+    return (pipeline == DR_PIPELINE_GLYPHS) ? sizeof(GlyphInstance) : sizeof(RectInstance);
+}
+
+Void dr_flush_vertices () {
+    DrRecorder *r = recorder;
+    Bool glyphs = (r->batch_pipeline == DR_PIPELINE_GLYPHS);
+    U32 *flushed = glyphs ? &r->glyphs_flushed : &r->rects_flushed;
+    U32 count = (glyphs ? r->glyphs.count : r->rects.count) - *flushed;
+    if (count == 0) return;
+
+    Auto cmd = array_push_slot(&r->cmds);
+    cmd->tag = DR_CMD_RECTS;
+    cmd->rects.first = *flushed;
+    cmd->rects.count = count;
+    cmd->rects.pipeline = r->batch_pipeline;
+    cmd->rects.texture_count = r->texture_slot_count;
+    cmd->label = r->label;
+    memcpy(cmd->rects.textures, r->texture_slots, sizeof(r->texture_slots));
+
+    F32 *b = r->batch_bounds;
+    cmd->rects.bounds = (Rect){ b[0], b[1], b[2]-b[0], b[3]-b[1] };
+    b[0] = b[1] = INFINITY;
+    b[2] = b[3] = -INFINITY;
+
+    *flushed += count;
+}
+
+// Rects and glyphs of different pipelines can't be in the same
+// batch, so the current one ends when the pipeline changes.
+static Void use_pipeline (DrPipeline pipeline) {
+    if (pipeline == recorder->batch_pipeline) return;
+    dr_flush_vertices();
+    recorder->batch_pipeline = pipeline;
+}
+
+RectInstance *dr_reserve_rects (U32 n) {
+    DrRecorder *r = recorder;
+    array_increase_count(&r->rects, n, false);
+    return &r->rects.data[r->rects.count - n];
+}
+
+// Adds to the frame hash and to the open hash span if there is
+// one. The bounds are in window coordinates and can be empty.
+static Void grow_bounds (F32 *b, F32 x0, F32 y0, F32 x1, F32 y1) {
+    b[0] = min(b[0], x0);
+    b[1] = min(b[1], y0);
+    b[2] = max(b[2], x1);
+    b[3] = max(b[3], y1);
+}
+
+static Void hash_draw (Void *data, U64 size, F32 x0, F32 y0, F32 x1, F32 y1) {
+    DrRecorder *r = recorder;
+    String s = { .data=data, .count=size };
+    r->hash = str_hash_seed(s, r->hash);
+
+    if (! r->hash_span_active) return;
+    r->hash_span = str_hash_seed(s, r->hash_span);
+    grow_bounds(r->hash_span_bounds, x0, y0, x1, y1);
+}
+
+Void dr_hash_begin () {
+    DrRecorder *r = recorder;
+    assert_dbg(! r->hash_span_active);
+    r->hash_span_active = true;
+    r->hash_span = 5381;
+    r->hash_span_bounds[0] = r->hash_span_bounds[1] = INFINITY;
+    r->hash_span_bounds[2] = r->hash_span_bounds[3] = -INFINITY;
+}
+
+U64 dr_hash_end (Rect *out_bounds) {
+    DrRecorder *r = recorder;
+    assert_dbg(r->hash_span_active);
+    r->hash_span_active = false;
+    F32 *b = r->hash_span_bounds;
+    *out_bounds = (b[0] < b[2]) ? (Rect){ b[0], b[1], b[2]-b[0], b[3]-b[1] } : (Rect){};
+    return r->hash_span;
+}
+
+Void dr_set_damage (Rect r) {
+    damage_was_set = true;
+    damage = r;
+}
+
+// Each level doubles the size of the blur.
+static U32 blur_levels (F32 strength) {
+    return clamp(cast(U32, strength), 1u, cast(U32, BLUR_MAX_LEVELS));
+}
+
+// How far outside of the blurred rect the blur reads pixels.
+// Downsampling into level i reaches 2^i pixels and upsampling
+// into level i reaches 2^(i+2) pixels.
+F32 dr_blur_margin (F32 strength) {
+    return 6 * (1 << blur_levels(strength)) + 2;
+}
+
+static U32 get_texture_slot () {
+    DrRecorder *r = recorder;
+    if (r->bound_texture_slot != -1) return r->bound_texture_slot;
+
+    for (U32 i = 0; i < r->texture_slot_count; ++i) {
+        if (r->texture_slots[i] == r->bound_texture) return r->bound_texture_slot = i;
+    }
+
+    if (r->texture_slot_count == MAX_TEXTURE_UNITS) {
+        dr_flush_vertices();
+        r->texture_slot_count = 0;
+    }
+
+    r->texture_slots[r->texture_slot_count] = r->bound_texture;
+    return r->bound_texture_slot = r->texture_slot_count++;
+}
+
+static U32 pack_color (Vec4 c) {
+    U32 r = 0;
+    for (U64 i = 0; i < 4; ++i) r |= cast(U32, clamp(c.v[i], 0.f, 1.f) * 255 + .5f) << (8*i);
+    return r;
+}
+
+// The thresholds are the ones the fragment shader uses. Whether
+// the rect is textured is decided by the packed text color since
+// that's what the shader sees.
+static DrPipeline pick_rect_pipeline (RectAttributes *a) {
+    Bool shadow   = a->outset_shadow_width > 0.001 || a->inset_shadow_width > 0.001;
+    Bool border   = a->border_widths.x > 0.001 || a->border_widths.y > 0.001 || a->border_widths.z > 0.001 || a->border_widths.w > 0.001;
+    Bool rounded  = a->radius.x != 0 || a->radius.y != 0 || a->radius.z != 0 || a->radius.w != 0;
+    Bool textured = (pack_color(a->text_color) >> 24) != 0;
+
+    if (shadow) return DR_PIPELINE_FULL;
+    if (textured) return (border || rounded || a->edge_softness != 0 || a->outset_shadow_width != 0) ? DR_PIPELINE_FULL : DR_PIPELINE_TEXTURED;
+    if (border || rounded) return DR_PIPELINE_ROUNDED;
+    return DR_PIPELINE_FLAT;
+}
+
+RectInstance *dr_rect_fn (RectAttributes *a) {
+    use_pipeline(pick_rect_pipeline(a));
+
+    U32 slot = (a->text_color.w > 0) ? get_texture_slot() : 0;
+    RectInstance *r = dr_reserve_rects(1);
+
+    if (a->color2.x == -1.0) a->color2 = a->color;
+
+    // We make the rect slightly bigger because the fragment
+    // shader will shrink it to make room for the drop shadow.
+    a->top_left.x     -= 2*a->outset_shadow_width + 2*a->edge_softness;
+    a->top_left.y     -= 2*a->outset_shadow_width + 2*a->edge_softness;
+    a->bottom_right.x += 2*a->outset_shadow_width + 2*a->edge_softness;
+    a->bottom_right.y += 2*a->outset_shadow_width + 2*a->edge_softness;
+
+    Vec2 top_left     = a->top_left;
+    Vec2 bottom_right = a->bottom_right;
+
+    a->top_left.y = win_height - a->top_left.y;
+    a->bottom_right.y = win_height - a->bottom_right.y;
+
+    U32 c1 = pack_color(a->color);
+    U32 c2 = pack_color(a->color2);
+
+    RectInstance i = {
+        .top_left            = a->top_left,
+        .bottom_right        = a->bottom_right,
+        .radius              = a->radius,
+        .border_widths       = a->border_widths,
+        .texture_rect        = a->texture_rect,
+        .shadow_offsets      = a->shadow_offsets,
+        .edge_softness       = a->edge_softness,
+        .outset_shadow_width = a->outset_shadow_width,
+        .inset_shadow_width  = a->inset_shadow_width,
+        .text_is_grayscale   = a->text_is_grayscale,
+        .colors[0]           = c1,
+        .colors[1]           = a->horizontal_gradient ? c1 : c2,
+        .colors[2]           = c2,
+        .colors[3]           = a->horizontal_gradient ? c2 : c1,
+        .border_color        = pack_color(a->border_color),
+        .inset_shadow_color  = pack_color(a->inset_shadow_color),
+        .outset_shadow_color = pack_color(a->outset_shadow_color),
+        .text_color          = pack_color(a->text_color),
+        .texture_slot        = slot,
+    };
+
+    *r = i;
+
+    // The slot depends on what else is in the batch, so we hash
+    // the texture itself.
+    i.texture_slot = (a->text_color.w > 0) ? recorder->bound_texture : 0;
+    F32 dx = fabsf(a->shadow_offsets.x);
+    F32 dy = fabsf(a->shadow_offsets.y);
+    hash_draw(&i, sizeof(i), top_left.x - dx, top_left.y - dy, bottom_right.x + dx, bottom_right.y + dy);
+    grow_bounds(recorder->batch_bounds, top_left.x - dx, top_left.y - dy, bottom_right.x + dx, bottom_right.y + dy);
+
+    return r;
+}
+
+// The top left is in window coordinates. A glyph with a fully
+// transparent color isn't drawn at all, unlike with dr_rect()
+// where only the color of the texture is ignored.
+Void dr_glyph (Vec2 top_left, U16 atlas_x, U16 atlas_y, U16 w, U16 h, Vec4 color, Bool grayscale) {
+    U32 c = pack_color(color);
+    if ((c >> 24) == 0 || w == 0 || h == 0) return;
+
+    use_pipeline(DR_PIPELINE_GLYPHS);
+    U32 slot = get_texture_slot();
+    DrRecorder *r = recorder;
+
+    GlyphInstance g = {
+        .top_left   = { top_left.x, win_height - top_left.y },
+        .atlas_rect = { atlas_x, atlas_y, w, h },
+        .color      = c,
+        .flags      = slot | (grayscale ? GLYPH_GRAYSCALE : 0),
+    };
+
+    array_push(&r->glyphs, g);
+
+    // The slot depends on what else is in the batch, so we hash
+    // the texture itself.
+    g.flags = r->bound_texture;
+    F32 x1 = top_left.x + w;
+    F32 y1 = top_left.y + h;
+    hash_draw(&g, sizeof(g), top_left.x, top_left.y, x1, y1);
+    hash_draw(&grayscale, sizeof(grayscale), top_left.x, top_left.y, x1, y1);
+    grow_bounds(r->batch_bounds, top_left.x, top_left.y, x1, y1);
+}
+
+Void dr_blur (Rect r, F32 strength, Vec4 corner_radius) {
+    dr_flush_vertices();
+    array_push_lit(&recorder->cmds, .tag=DR_CMD_BLUR, .label=recorder->label, .blur={ r, strength, corner_radius });
+    hash_draw(&r, sizeof(r), r.x, r.y, r.x+r.w, r.y+r.h);
+    hash_draw(&strength, sizeof(strength), r.x, r.y, r.x+r.w, r.y+r.h);
+    hash_draw(&corner_radius, sizeof(corner_radius), r.x, r.y, r.x+r.w, r.y+r.h);
+}
+
+Void dr_scissor (Rect r) {
+    array_push_lit(&recorder->cmds, .tag=DR_CMD_SCISSOR, .scissor=r);
+    hash_draw(&r, sizeof(r), INFINITY, INFINITY, -INFINITY, -INFINITY);
+}
+
+// =============================================================================
+// Background blur:
+// ----------------
+//
+// This is a dual Kawase filter. The area behind the blurred rect
+// is downsampled a few times, halving the resolution each time,
+// and then upsampled back with a tent filter. Every pass reads a
+// fixed number of texels, so the cost per pixel doesn't depend
+// on the strength which only picks the number of levels.
+//
+// The passes only process the blurred rect grown by the margin
+// that the filter reaches. Blurs that are replayed one after the
+// other with nothing drawn under them in between share a single
+// capture that covers all of them.
+// =============================================================================
+static Bool rects_overlap (Rect a, Rect b) {
+    return (a.x < b.x + b.w) && (b.x < a.x + a.w) && (a.y < b.y + b.h) && (b.y < a.y + a.h);
+}
+
+static Bool rect_contains (Rect a, Rect b) {
+    return (b.x >= a.x) && (b.y >= a.y) && (b.x + b.w <= a.x + a.w) && (b.y + b.h <= a.y + a.h);
+}
+
+static Rect rect_union (Rect a, Rect b) {
+    if (a.w <= 0 || a.h <= 0) return b;
+    if (b.w <= 0 || b.h <= 0) return a;
+    F32 x0 = min(a.x, b.x);
+    F32 y0 = min(a.y, b.y);
+    F32 x1 = max(a.x + a.w, b.x + b.w);
+    F32 y1 = max(a.y + a.h, b.y + b.h);
+    return (Rect){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+static Rect blur_area (Rect r, F32 strength) {
+    F32 m  = dr_blur_margin(strength);
+    F32 x0 = max(0, r.x - m);
+    F32 y0 = max(0, r.y - m);
+    F32 x1 = min(win_width, r.x + r.w + m);
+    F32 y1 = min(win_height, r.y + r.h + m);
+    return (Rect){ x0, y0, max(0, x1 - x0), max(0, y1 - y0) };
+}
+
+static Void blur_set_quad (F32 x0, F32 y0, F32 x1, F32 y1) {
+    blur_vertices.count = 0;
+    array_push_lit(&blur_vertices, x0, y1);
+    array_push_lit(&blur_vertices, x1, y1);
+    array_push_lit(&blur_vertices, x0, y0);
+    array_push_lit(&blur_vertices, x0, y0);
+    array_push_lit(&blur_vertices, x1, y1);
+    array_push_lit(&blur_vertices, x1, y0);
+    glNamedBufferData(blur_VBO, array_size(&blur_vertices), blur_vertices.data, GL_STREAM_DRAW);
+}
+
+// Renders the area (in window coordinates) of the given blur
+// level from the level before or after it. Level 0 is the
+// framebuffer itself.
+static Void blur_pass (U32 level, U32 source_level, Rect area) {
+    Int w  = max(1, win_width >> level);
+    Int h  = max(1, win_height >> level);
+    F32 s  = 1 << level;
+
+    Int x0 = clamp(cast(Int, floorf(area.x / s)) - 1, 0, w);
+    Int x1 = clamp(cast(Int, ceilf((area.x + area.w) / s)) + 1, 0, w);
+    Int y0 = clamp(cast(Int, floorf((win_height - area.y - area.h) / s)) - 1, 0, h);
+    Int y1 = clamp(cast(Int, ceilf((win_height - area.y) / s)) + 1, 0, h);
+
+    RenderTarget *source = source_level ? blur_targets[source_level] : frame_target;
+    gl_bind_framebuffer(GL_FRAMEBUFFER, blur_targets[level]->fbo);
+    gl_bind_texture(0, source->texture);
+    gl_viewport(0, 0, w, h);
+    gl_scissor(x0, y0, x1 - x0, y1 - y0);
+
+    set_int(&blur_shader, "pass", (source_level < level) ? BLUR_DOWNSAMPLE : BLUR_UPSAMPLE);
+    set_float(&blur_shader, "source_scale", (source_level < level) ? 2.f : .5f);
+    set_vec2(&blur_shader, "source_size", vec2(max(1, win_width >> source_level), max(1, win_height >> source_level)));
+    glDrawArrays(GL_TRIANGLES, 0, blur_vertices.count);
+}
+
+static Void blur_capture_area (Rect area, U32 levels) {
+    gl_bind_vao(blur_VAO);
+    gl_use_program(&blur_shader);
+    set_mat4(&blur_shader, "projection", mat4(1));
+    blur_set_quad(-1, -1, 1, 1);
+
+    for (U32 i = 1; i <= levels; ++i) blur_pass(i, i - 1, area);
+    for (U32 i = levels - 1; i >= 1; --i) blur_pass(i, i + 1, area);
+
+    blur_capture = (BlurCapture){ .valid=true, .levels=levels, .area=area };
+}
+
+// Draws the blurred content of the framebuffer into the rect of
+// the blur command at the given index. The result is clipped to
+// the damaged area.
+static Void blur (U64 cmd_idx, Int *damage_scissor) {
+    Auto b = &array_ref(&main_recorder.cmds, cmd_idx)->blur;
+    U32 levels = blur_levels(b->strength);
+    Rect area = blur_area(b->rect, b->strength);
+
+    Bool reuse = blur_capture.valid &&
+                 blur_capture.levels == levels &&
+                 rect_contains(blur_capture.area, area) &&
+                 !rects_overlap(blur_capture.dirty, area);
+
+    if (! reuse) {
+        // Grow the capture to cover the blurs coming up that won't
+        // have anything drawn under them before their turn, which
+        // includes the output of this blur and the ones before them.
+        // Blurs that are far apart aren't merged since we would end
+        // up blurring a lot of pixels that nobody looks at.
+        Rect dirty = b->rect;
+        F32 pixels = area.w * area.h;
+
+        array_iter_from (cmd, &main_recorder.cmds, cmd_idx + 1, *) {
+            if (cmd->tag == DR_CMD_RECTS) dirty = rect_union(dirty, cmd->rects.bounds);
+            if (cmd->tag != DR_CMD_BLUR) continue;
+
+            Rect a = blur_area(cmd->blur.rect, cmd->blur.strength);
+            Bool mergeable = (blur_levels(cmd->blur.strength) == levels) && !rects_overlap(dirty, a);
+            dirty = rect_union(dirty, cmd->blur.rect);
+            if (! mergeable) continue;
+
+            Rect u = rect_union(area, a);
+            if (u.w * u.h > 2 * (pixels + a.w * a.h)) continue;
+
+            area = u;
+            pixels += a.w * a.h;
+        }
+
+        blur_capture_area(area, levels);
+    }
+
+    Rect r = b->rect;
+    r.y = win_height - r.y;
+
+    gl_bind_vao(blur_VAO);
+    gl_use_program(&blur_shader);
+    gl_bind_framebuffer(GL_FRAMEBUFFER, frame_target->fbo);
+    gl_bind_texture(0, blur_targets[1]->texture);
+    gl_viewport(0, 0, win_width, win_height);
+    gl_scissor(damage_scissor[0], damage_scissor[1], damage_scissor[2], damage_scissor[3]);
+    blur_set_quad(r.x, r.y - r.h, r.x + r.w, r.y);
+
+    set_mat4(&blur_shader, "projection", projection);
+    set_int(&blur_shader, "pass", BLUR_DRAW);
+    set_float(&blur_shader, "source_scale", .5f);
+    set_vec2(&blur_shader, "source_size", vec2(max(1, win_width >> 1), max(1, win_height >> 1)));
+    set_vec2(&blur_shader, "half_size", vec2(r.w/2, r.h/2));
+    set_vec2(&blur_shader, "center", vec2(r.x+r.w/2, r.y-r.h/2));
+    set_vec4(&blur_shader, "radius", b->corner_radius);
+    glDrawArrays(GL_TRIANGLES, 0, blur_vertices.count);
+
+    // Blurs that overlap this one have to see it.
+    blur_capture.dirty = rect_union(blur_capture.dirty, b->rect);
+}
+
+Void dr_bind_texture (Texture *texture) {
+    DrRecorder *r = recorder;
+    if (r->bound_texture == texture->id) return;
+    r->bound_texture = texture->id;
+    r->bound_texture_slot = -1;
+}
+
+Texture dr_2d_texture_alloc (U32 width, U32 height) {
+    if (software) return (Texture){ .id=sw_texture_new(width, height), .width=width, .height=height };
+
+    U32 id;
+    glCreateTextures(GL_TEXTURE_2D, 1, &id);
+    glTextureStorage2D(id, 1, GL_RGBA8, width, height);
+    glTextureParameteri(id, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(id, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(id, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(id, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return (Texture){.id=id, .width=width, .height=height};
+}
+
+// The update is deferred so that rects recorded before it still
+// see the old content of the texture when the frame is replayed.
+// Only the main recorder may take updates, so that splicing the
+// segment recorders can't reorder an update and its users.
+Void dr_2d_texture_update (Texture *texture, U32 x, U32 y, U32 w, U32 h, U8 *buf) {
+    assert_always(recorder == &main_recorder);
+    U64 size = 4 * w * h;
+    U8 *copy = mem_alloc(recorder->mem, U8, .size=size);
+    memcpy(copy, buf, size);
+    array_push_lit(&recorder->cmds, .tag=DR_CMD_TEXTURE_UPDATE, .texture_update={ texture->id, x, y, w, h, copy });
+
+    U32 header[] = { texture->id, x, y, w, h };
+    hash_draw(header, sizeof(header), INFINITY, INFINITY, -INFINITY, -INFINITY);
+    hash_draw(copy, size, INFINITY, INFINITY, -INFINITY, -INFINITY);
+}
+
+// =============================================================================
+// Async images:
+// -------------
+//
+// dr_image_load() only reads the header of the file on a small
+// thread pool. The pixels are decoded when dr_image_texture()
+// asks for a size that isn't resident yet. The workers decode
+// the file, box filter it down to the requested variant in the
+// staging buffer, and put it on the decoded list. win_wake() is
+// then called in case win_run is blocked waiting for input.
+// Variant n is the image halved n times, and the one requested
+// is the smallest that is still at least as wide as the box, so
+// thumbnails of big images don't keep the original in video
+// memory.
+//
+// At the start of each frame the main thread first evicts the
+// variants that the last frame didn't use. Originals are always
+// evicted, since those are the big ones. The others are only
+// evicted, least recently used first, while the total is above
+// the budget set with dr_image_budget(). Then the main thread
+// moves the decoded images into the upload queue and uploads
+// bands of rows from it until DR_IMAGE_UPLOAD_BUDGET bytes have
+// been uploaded, so that a big image is spread over a few frames
+// rather than stalling one. At least one band is uploaded per
+// frame. The mipmaps are generated after the last band.
+// =============================================================================
+#define IMAGE_DECODE_THREADS 2
+#define IMAGE_QUEUE_SIZE     64
+#define IMAGE_MAX_VARIANTS   16
+
+istruct (ImageVariant) {
+    Texture texture; // Id is 0 unless resident.
+    Bool pending; // Being decoded or uploaded.
+    U64 last_used; // Value of image_frame.
+    U64 bytes;
+};
+
+istruct (ImageEntry) {
+    DrImage image; // Must be first; the handle given out.
+    CString filepath;
+    Bool flip;
+    U32 channels;
+    ImageVariant variants[IMAGE_MAX_VARIANTS];
+};
+
+// With level -1 the job only reads the header of the file.
+istruct (ImageJob) {
+    ImageEntry *entry;
+    I32 level;
+    U8 *pixels; // Staging buffer. NULL if decoding failed.
+    U32 width;
+    U32 height;
+    U32 channels;
+    U32 texture; // Not put into the variant until fully uploaded.
+    U32 rows_uploaded;
+};
+
+array_typedef(ImageEntry*, ImageEntry);
+array_typedef(ImageJob*, ImageJob);
+
+static TPool *image_pool;
+static OsMutex *image_mutex;
+static ArrayImageJob images_decoded; // Guarded by image_mutex.
+static ArrayImageJob image_uploads;
+static ArrayImageEntry image_entries;
+static U64 image_frame;
+static DrImageStats image_stats = { .budget=DR_IMAGE_TEXTURE_BUDGET };
+
+// Every output pixel is the average of the block of input pixels
+// that it covers. Since the blocks of later output pixels start
+// after the current one, this can be done in place.
+static Void downscale_in_place (U8 *pixels, U32 sw, U32 sh, U32 dw, U32 dh, U32 channels) {
+    for (U32 y = 0; y < dh; ++y) {
+        U32 y0 = cast(U64, y) * sh / dh;
+        U32 y1 = cast(U64, y + 1) * sh / dh;
+
+        for (U32 x = 0; x < dw; ++x) {
+            U32 x0 = cast(U64, x) * sw / dw;
+            U32 x1 = cast(U64, x + 1) * sw / dw;
+            U64 sum[4] = {}; // A big downscale factor could overflow 32 bits.
+
+            for (U32 sy = y0; sy < y1; ++sy) {
+                U8 *row = pixels + (cast(U64, sy) * sw + x0) * channels;
+                for (U32 i = 0; i < (x1 - x0) * channels; ++i) sum[i % channels] += row[i];
+            }
+
+            U64 n = cast(U64, y1 - y0) * (x1 - x0);
+            U8 *out = pixels + (cast(U64, y) * dw + x) * channels;
+            for (U32 c = 0; c < channels; ++c) out[c] = (sum[c] + n/2) / n;
+        }
+    }
+}
+
+static TPOOL_FN(decode_image) {
+    ImageJob *job = arg;
+    ImageEntry *entry = job->entry;
+    Int w, h, n;
+
+    if (job->level < 0) {
+        // RGB images are kept as such for the GL backend to save some
+        // upload bandwidth. The software rasterizer only knows RGBA.
+        if (stbi_info(entry->filepath, &w, &h, &n)) {
+            job->width = w;
+            job->height = h;
+            job->channels = (n == 3 && !software) ? 3 : 4;
+        }
+    } else {
+        stbi_set_flip_vertically_on_load_thread(entry->flip);
+        job->pixels = stbi_load(entry->filepath, &w, &h, &n, job->channels);
+
+        if (job->pixels) {
+            job->width = max(1, w >> job->level);
+            job->height = max(1, h >> job->level);
+            if (job->level) downscale_in_place(job->pixels, w, h, job->width, job->height, job->channels);
+        }
+    }
+
+    {
+        os_mutex_scoped_lock(image_mutex);
+        array_push(&images_decoded, job);
+    }
+
+    win_wake();
+}
+
+static Void image_job_push (ImageEntry *entry, I32 level) {
+    ImageJob *job = mem_new(mem_root, ImageJob);
+    job->entry    = entry;
+    job->level    = level;
+    job->channels = entry->channels;
+    if (level >= 0) entry->variants[level].pending = true;
+    image_stats.pending++;
+    tpool_push(image_pool, decode_image, job);
+}
+
+DrImage *dr_image_load (CString filepath, Bool flip) {
+    if (! image_pool) {
+        image_pool  = tpool_new(mem_root, IMAGE_DECODE_THREADS, IMAGE_QUEUE_SIZE);
+        image_mutex = os_mutex_new(mem_root);
+        array_init(&images_decoded, mem_root);
+        array_init(&image_uploads, mem_root);
+        array_init(&image_entries, mem_root);
+    }
+
+    ImageEntry *entry = mem_new(mem_root, ImageEntry);
+    entry->filepath   = cstr(mem_root, str(filepath));
+    entry->flip       = flip;
+    array_push(&image_entries, entry);
+    image_job_push(entry, -1);
+    return &entry->image;
+}
+
+Texture *dr_image_texture (DrImage *image, F32 width) {
+    if (image->state != DR_IMAGE_READY) return 0;
+    ImageEntry *entry = cast(ImageEntry*, image);
+
+    U32 level = 0;
+    while (level + 1 < IMAGE_MAX_VARIANTS && (image->width >> (level + 1)) >= max(width, 1)) level++;
+
+    ImageVariant *variant = &entry->variants[level];
+    variant->last_used = image_frame;
+    if (variant->texture.id) return &variant->texture;
+    if (! variant->pending) image_job_push(entry, level);
+
+    // Until it's resident the nearest variant that is gets drawn,
+    // preferring the bigger ones.
+    for (I32 l = level - 1; l >= 0; --l) {
+        ImageVariant *v = &entry->variants[l];
+        if (v->texture.id) { v->last_used = image_frame; return &v->texture; }
+    }
+
+    for (U32 l = level + 1; l < IMAGE_MAX_VARIANTS; ++l) {
+        ImageVariant *v = &entry->variants[l];
+        if (v->texture.id) { v->last_used = image_frame; return &v->texture; }
+    }
+
+    return 0;
+}
+
+Void dr_image_budget (U64 bytes) {
+    image_stats.budget = bytes;
+}
+
+DrImageStats *dr_get_image_stats () {
+    return &image_stats;
+}
+
+static U32 image_texture_new (ImageJob *job) {
+    U32 w = job->width;
+    U32 h = job->height;
+
+    if (software) return sw_texture_new(w, h);
+
+    U32 id;
+    U32 levels = 1 + cast(U32, log2(max(w, h)));
+    glCreateTextures(GL_TEXTURE_2D, 1, &id);
+    glTextureStorage2D(id, levels, (job->channels == 3) ? GL_RGB8 : GL_RGBA8, w, h);
+    glTextureParameteri(id, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTextureParameteri(id, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTextureParameteri(id, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTextureParameteri(id, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    return id;
+}
+
+static Void image_variant_free (ImageVariant *variant) {
+    U32 id = variant->texture.id;
+
+    if (software) {
+        sw_texture_free(id);
+    } else {
+        gl_delete_texture(id);
+    }
+
+    image_stats.texture_bytes -= variant->bytes;
+    image_stats.variants--;
+    image_stats.evictions++;
+    variant->texture = (Texture){};
+    variant->bytes = 0;
+}
+
+static Void evict_images () {
+    array_iter (entry, &image_entries) {
+        ImageVariant *original = &entry->variants[0];
+        if (original->texture.id && original->last_used < image_frame) image_variant_free(original);
+    }
+
+    while (image_stats.texture_bytes > image_stats.budget) {
+        ImageVariant *lru = 0;
+
+        array_iter (entry, &image_entries) {
+            for (U32 l = 1; l < IMAGE_MAX_VARIANTS; ++l) {
+                ImageVariant *v = &entry->variants[l];
+                if (!v->texture.id || v->last_used >= image_frame) continue;
+                if (!lru || v->last_used < lru->last_used) lru = v;
+            }
+        }
+
+        if (! lru) break; // Everything left is in use.
+        image_variant_free(lru);
+    }
+}
+
+static Void image_upload_rows (ImageJob *job, U32 count) {
+    U32 w = job->width;
+    U32 y = job->rows_uploaded;
+    U8 *rows = job->pixels + cast(U64, y) * w * job->channels;
+
+    if (software) {
+        sw_texture_update(job->texture, 0, y, w, count, rows);
+    } else {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTextureSubImage2D(job->texture, 0, 0, y, w, count, (job->channels == 3) ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, rows);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+
+    job->rows_uploaded += count;
+}
+
+static Void image_fail (ImageJob *job) {
+    ImageEntry *entry = job->entry;
+    if (entry->image.state != DR_IMAGE_FAILED) log_msg_fmt(LOG_ERROR, "Win", 1, "Couldn't load image from file: %s", entry->filepath);
+    entry->image.state = DR_IMAGE_FAILED;
+    if (job->level >= 0) entry->variants[job->level].pending = false;
+    image_stats.pending--;
+    mem_free(mem_root, .old_ptr=job, .old_size=sizeof(ImageJob));
+}
+
+static Void upload_images () {
+    if (! image_pool) return;
+
+    evict_images();
+    image_frame++;
+
+    {
+        os_mutex_scoped_lock(image_mutex);
+
+        array_iter (job, &images_decoded) {
+            ImageEntry *entry = job->entry;
+
+            if (! job->width) {
+                image_fail(job);
+            } else if (job->level < 0) {
+                entry->image.width  = job->width;
+                entry->image.height = job->height;
+                entry->channels     = job->channels;
+                entry->image.state  = DR_IMAGE_READY;
+                image_stats.pending--;
+                mem_free(mem_root, .old_ptr=job, .old_size=sizeof(ImageJob));
+            } else {
+                array_push(&image_uploads, job);
+            }
+        }
+
+        images_decoded.count = 0;
+    }
+
+    U64 budget = DR_IMAGE_UPLOAD_BUDGET;
+
+    while (image_uploads.count && budget) {
+        ImageJob *job = array_get(&image_uploads, 0);
+        if (! job->texture) job->texture = image_texture_new(job);
+
+        U64 row_size = cast(U64, job->width) * job->channels;
+        U32 rows     = clamp(budget / row_size, 1ul, cast(U64, job->height - job->rows_uploaded));
+        image_upload_rows(job, rows);
+        budget -= min(budget, rows * row_size);
+
+        if (job->rows_uploaded == job->height) {
+            if (! software) glGenerateTextureMipmap(job->texture);
+            stbi_image_free(job->pixels);
+
+            ImageVariant *variant = &job->entry->variants[job->level];
+            variant->texture = (Texture){ .id=job->texture, .width=job->width, .height=job->height };
+            variant->pending = false;
+            variant->bytes   = row_size * job->height;
+            if (! software) variant->bytes += variant->bytes / 3; // Mipmaps.
+
+            image_stats.texture_bytes += variant->bytes;
+            image_stats.variants++;
+            image_stats.pending--;
+            array_remove(&image_uploads, 0);
+            mem_free(mem_root, .old_ptr=job, .old_size=sizeof(ImageJob));
+        }
+    }
+}
+
+// =============================================================================
+// Command sorting:
+// ----------------
+//
+// Before the replay the recorded commands are rearranged so that
+// they need fewer draw calls. Blurs, and texture updates of the
+// textures in use, split the list into layers that are never
+// reordered with respect to each other. Within a layer each DR_CMD_RECTS is appended to the last
+// batch that has the same scissor and agrees with it about the
+// textures in the slots they both use. The batches in between
+// must not overlap it, since the rects have to stay on top of
+// whatever was recorded before them.
+//
+// The rects are copied into the ring in the order of the sorted
+// batches, so each batch ends up as a single draw call.
+// =============================================================================
+istruct (DrBatch) {
+    U32 first_cmd; // Index into the cmds of main_recorder. The rest are chained through batch_next.
+    U32 last_cmd;
+    U32 count;
+    DrPipeline pipeline;
+    Rect scissor; // In GL coordinates.
+    Rect bounds;  // In window coordinates, clipped to the scissor.
+    U32 texture_count;
+    U32 textures[MAX_TEXTURE_UNITS];
+    CString label;
+};
+
+Array(DrBatch) batches;
+U32 *batch_next; // Indexed by the cmd index. Allocated in the mem of main_recorder.
+
+static Rect rect_intersect (Rect a, Rect b) {
+    F32 x0 = max(a.x, b.x);
+    F32 y0 = max(a.y, b.y);
+    F32 x1 = min(a.x + a.w, b.x + b.w);
+    F32 y1 = min(a.y + a.h, b.y + b.h);
+    return (Rect){ x0, y0, max(0, x1 - x0), max(0, y1 - y0) };
+}
+
+static Bool batch_accepts (DrBatch *batch, DrCmd *cmd, Rect scissor) {
+    if (memcmp(&batch->scissor, &scissor, sizeof(Rect))) return false;
+    if (batch->pipeline != cmd->rects.pipeline) return false;
+
+    // Labels are only set while profiling. They are compared by
+    // content because dr_label() copies them into each recorder.
+    if (batch->label != cmd->label && (!batch->label || !cmd->label || !cstr_match(batch->label, cmd->label))) return false;
+
+    U32 n = min(batch->texture_count, cmd->rects.texture_count);
+    for (U32 i = 0; i < n; ++i) {
+        if (batch->textures[i] != cmd->rects.textures[i]) return false;
+    }
+
+    return true;
+}
+
+static Void sort_rects (U32 cmd_idx, Rect scissor, U64 layer_start) {
+    DrCmd *cmd = array_ref(&main_recorder.cmds, cmd_idx);
+    Rect s = { scissor.x, win_height - scissor.y - scissor.h, scissor.w, scissor.h };
+    Rect bounds = rect_intersect(cmd->rects.bounds, s);
+    if (bounds.w == 0 || bounds.h == 0) return;
+
+    for (U64 i = batches.count; i-- > layer_start;) {
+        DrBatch *batch = array_ref(&batches, i);
+
+        if (batch_accepts(batch, cmd, scissor)) {
+            batch_next[batch->last_cmd] = cmd_idx;
+            batch->last_cmd = cmd_idx;
+            batch->count += cmd->rects.count;
+            batch->bounds = rect_union(batch->bounds, bounds);
+
+            if (cmd->rects.texture_count > batch->texture_count) {
+                U32 n = cmd->rects.texture_count - batch->texture_count;
+                memcpy(&batch->textures[batch->texture_count], &cmd->rects.textures[batch->texture_count], n * sizeof(U32));
+                batch->texture_count = cmd->rects.texture_count;
+            }
+
+            frame_stats.batches_merged++;
+            return;
+        }
 
-SDL_Window *window;
-SDL_GLContext gl_ctx;
-ArrayEvent events;
+        if (rects_overlap(batch->bounds, bounds)) break;
+    }
 
-Int win_width  = 1000;
-Int win_height = 600;
+    Auto batch = array_push_slot(&batches);
+    batch->first_cmd = cmd_idx;
+    batch->last_cmd = cmd_idx;
+    batch->count = cmd->rects.count;
+    batch->pipeline = cmd->rects.pipeline;
+    batch->scissor = scissor;
+    batch->bounds = bounds;
+    batch->texture_count = cmd->rects.texture_count;
+    batch->label = cmd->label;
+    memcpy(batch->textures, cmd->rects.textures, sizeof(batch->textures));
+}
 
-SDL_Cursor *cursors[SDL_SYSTEM_CURSOR_COUNT];
+// A texture update only has to end the layer if a batch of the
+// layer reads the texture. Otherwise it's emitted right away and
+// the whole layer is drawn after it.
+static Bool layer_uses_texture (U64 layer_start, U32 texture) {
+    array_iter_from (batch, &batches, layer_start, *) {
+        for (U32 i = 0; i < batch->texture_count; ++i) {
+            if (batch->textures[i] == texture) return true;
+        }
+    }
 
-#define BLUR_SHRINK 4
-U32 blur_shader;
-U32 blur_VBO, blur_VAO;
-U32 blur_buffer1;
-U32 blur_buffer2;
-U32 blur_tex1;
-U32 blur_tex2;
-Array(struct { Vec2 pos; }) blur_vertices;
+    return false;
+}
 
-ArrayVertex vertices;
+static Void emit_batches (U64 layer_start, Rect *scissor) {
+    array_iter_from (batch, &batches, layer_start, *) {
+        if (memcmp(&batch->scissor, scissor, sizeof(Rect))) {
+            *scissor = batch->scissor;
+            array_push_lit(&sorted_cmds, .tag=DR_CMD_SCISSOR, .scissor=*scissor);
+        }
 
-U32 rect_shader;
-U32 VBO, VAO;
-Mat4 projection;
-U32 framebuffer;
-U32 framebuffer_tex;
+        U32 size = instance_size(batch->pipeline);
+        U8 *instances = (batch->pipeline == DR_PIPELINE_GLYPHS) ? cast(U8*, main_recorder.glyphs.data) : cast(U8*, main_recorder.rects.data);
+        U64 region_start = cast(U64, ring.region) * ring.capacity;
+        U64 first = (region_start + ring.count + size - 1) / size;
+        ring.count = first * size - region_start;
+
+        Auto cmd = array_push_slot(&sorted_cmds);
+        cmd->tag = DR_CMD_RECTS;
+        cmd->rects.first = first;
+        cmd->rects.count = batch->count;
+        cmd->rects.pipeline = batch->pipeline;
+        cmd->rects.texture_count = batch->texture_count;
+        cmd->rects.bounds = batch->bounds;
+        cmd->label = batch->label;
+        memcpy(cmd->rects.textures, batch->textures, sizeof(batch->textures));
+
+        for (U32 c = batch->first_cmd;; c = batch_next[c]) {
+            Auto r = &array_ref(&main_recorder.cmds, c)->rects;
+            memcpy(&ring.data[region_start + ring.count], &instances[r->first * size], r->count * size);
+            ring.count += r->count * size;
+            if (c == batch->last_cmd) break;
+        }
+    }
+}
 
-U32 screen_shader;
-U32 screen_VBO, screen_VAO;
-Array(struct { Vec2 pos; Vec2 tex; }) screen_vertices;
+static Void dump_cmd_list (CString title, ArrayDrCmd *list) {
+    U64 draw_calls = 0;
+    array_iter (cmd, list, *) if (cmd->tag == DR_CMD_RECTS) draw_calls++;
+
+    log_msg(m, LOG_NOTE, "Win", 1);
+    astr_push_fmt(m, "%s: %" PRIu64 " commands, %" PRIu64 " draw calls\n", title, list->count, draw_calls);
+
+    array_iter (cmd, list, *) {
+        astr_push_fmt(m, "  %4lu ", ARRAY_IDX);
+
+        switch (cmd->tag) {
+        case DR_CMD_RECTS: {
+            Auto r = &cmd->rects;
+            astr_push_fmt(m, "rects    first=%u count=%u pipeline=%u bounds=(%.0f %.0f %.0f %.0f) textures=[", r->first, r->count, r->pipeline, r->bounds.x, r->bounds.y, r->bounds.w, r->bounds.h);
+            for (U32 i = 0; i < r->texture_count; ++i) astr_push_fmt(m, i ? " %u" : "%u", r->textures[i]);
+            astr_push_cstr(m, "]\n");
+        } break;
+
+        case DR_CMD_SCISSOR: {
+            Rect r = cmd->scissor;
+            astr_push_fmt(m, "scissor  (%.0f %.0f %.0f %.0f)\n", r.x, r.y, r.w, r.h);
+        } break;
+
+        case DR_CMD_BLUR: {
+            Rect r = cmd->blur.rect;
+            astr_push_fmt(m, "blur     (%.0f %.0f %.0f %.0f) strength=%.1f\n", r.x, r.y, r.w, r.h, cmd->blur.strength);
+        } break;
+
+        case DR_CMD_TEXTURE_UPDATE: {
+            Auto u = &cmd->texture_update;
+            astr_push_fmt(m, "update   texture=%u (%u %u %u %u)\n", u->texture, u->x, u->y, u->w, u->h);
+        } break;
+        }
+    }
+}
 
-static Void set_bool  (U32 p, CString name, Bool v) { glUniform1i(glGetUniformLocation(p, name), cast(Int, v)); }
-static Void set_int   (U32 p, CString name, Int v)  { glUniform1i(glGetUniformLocation(p, name), v); }
-static Void set_float (U32 p, CString name, F32 v)  { glUniform1f(glGetUniformLocation(p, name), v); }
-static Void set_vec2  (U32 p, CString name, Vec2 v) { glUniform2f(glGetUniformLocation(p, name), v.x, v.y); }
-static Void set_vec4  (U32 p, CString name, Vec4 v) { glUniform4f(glGetUniformLocation(p, name), v.x, v.y, v.z, v.w); }
-static Void set_mat4  (U32 p, CString name, Mat4 m) { glUniformMatrix4fv(glGetUniformLocation(p, name), 1, GL_FALSE, cast(F32*, &m)); }
+Void dr_dump_cmds () {
+    dump_cmds = true;
+}
 
-#define ATTR(T, OFFSET, LEN, NAME) ({\
-    glVertexAttribPointer(OFFSET, LEN, GL_FLOAT, GL_FALSE, sizeof(T), cast(Void*, offsetof(T, NAME)));\
-    glEnableVertexAttribArray(OFFSET);\
-})
+// Replaces the cmds of the main recorder with the sorted list
+// and copies the instances into the current region of the ring.
+static Void sort_cmds () {
+    DrRecorder *r = &main_recorder;
+    if (dump_cmds) dump_cmd_list("Recorded", &r->cmds);
+
+    // Each batch can be preceded by up to an instance of padding.
+    U64 size = r->rects.count * sizeof(RectInstance) + r->glyphs.count * sizeof(GlyphInstance) + r->cmds.count * sizeof(RectInstance);
+    while (size > ring.capacity) ring_grow();
+
+    batch_next = mem_alloc(r->mem, U32, .size=(r->cmds.count * sizeof(U32)));
+    batches.count = 0;
+    sorted_cmds.count = 0;
+
+    U64 layer_start = 0;
+    Rect scissor = { 0, 0, win_width, win_height };
+    Rect emitted_scissor = scissor;
+
+    array_iter (cmd, &r->cmds, *) {
+        switch (cmd->tag) {
+        case DR_CMD_SCISSOR: scissor = cmd->scissor; break;
+        case DR_CMD_RECTS:   sort_rects(ARRAY_IDX, scissor, layer_start); break;
+
+        case DR_CMD_TEXTURE_UPDATE: {
+            if (layer_uses_texture(layer_start, cmd->texture_update.texture)) {
+                emit_batches(layer_start, &emitted_scissor);
+                layer_start = batches.count;
+            }
 
-Noreturn static Void error () {
-    log_scope_end_all();
-    panic();
+            array_push(&sorted_cmds, *cmd);
+        } break;
+
+        case DR_CMD_BLUR: {
+            emit_batches(layer_start, &emitted_scissor);
+            layer_start = batches.count;
+            array_push(&sorted_cmds, *cmd);
+        } break;
+        }
+    }
+
+    emit_batches(layer_start, &emitted_scissor);
+    swap(r->cmds, sorted_cmds);
+
+    if (dump_cmds) dump_cmd_list("Sorted", &r->cmds);
+    dump_cmds = false;
 }
 
-Noreturn Fmt(1, 2) static Void error_fmt (CString fmt, ...) {
-    log_msg(m, LOG_ERROR, "Win", 1);
-    astr_push_fmt_vam(m, fmt);
-    astr_push_byte(m, '\n');
-    error();
+static Void discard_frame () {
+    recorder_clear(&main_recorder);
+    damage_was_set = false;
+    damage_everything = false;
 }
 
-static Void update_projection () {
-    F32 h = cast(F32, win_height);
-    F32 w = cast(F32, win_width);
-    projection = mat_ortho(0, w, 0, h, -1.f, 1.f);
+static Void scissor_within_damage (Rect r, Int *d) {
+    Int x0 = max(cast(Int, r.x), d[0]);
+    Int y0 = max(cast(Int, r.y), d[1]);
+    Int x1 = min(cast(Int, r.x) + cast(Int, r.w), d[0] + d[2]);
+    Int y1 = min(cast(Int, r.y) + cast(Int, r.h), d[1] + d[3]);
+    gl_scissor(x0, y0, max(0, x1 - x0), max(0, y1 - y0));
 }
 
-static U32 framebuffer_new (U32 *out_texture, Bool only_color_attach, U32 w, U32 h) {
-    U32 r;
-    glGenFramebuffers(1, &r);
-    glBindFramebuffer(GL_FRAMEBUFFER, r);
+// =============================================================================
+// GPU profiling:
+// --------------
+//
+// While enabled, every pass of the replay is wrapped in a query
+// of GL_TIME_ELAPSED: each draw call of rects or glyphs, each blur
+// and the composite into the window. The queries of a frame are
+// read back when their set comes around again GPU_QUERY_FRAMES
+// presented frames later. There is one more set than there are
+// ring regions in flight, so the GPU is usually done with them by
+// then. If the results still aren't available, that frame's
+// timings are dropped instead of stalling on them.
+//
+// Passes are attributed to the label set with dr_label() when they
+// were recorded; the ui sets the label of the box being drawn. To
+// keep that exact, batches with different labels aren't merged
+// while profiling, which means more draw calls than usual.
+// =============================================================================
+#define GPU_QUERY_FRAMES (RING_REGIONS + 1)
+
+istruct (GpuQueryFrame) {
+    Array(U32) queries; // Reused across frames, grown as needed.
+    ArrayDrGpuTiming timings; // Parallel to the first count queries.
+    Mem *mem; // For the label copies.
+    U32 count;
+    Bool pending; // Has queries that weren't read back yet.
+};
+
+Bool gpu_profile;
+GpuQueryFrame gpu_query_frames[GPU_QUERY_FRAMES];
+U64 gpu_query_frame; // Number of frames profiled.
+ArrayDrGpuTiming gpu_timings; // Of the last frame that was read back.
+Mem *gpu_timings_mem;
+Bool gpu_timings_logged;
+
+Void dr_gpu_profile (Bool enable) {
+    if (software) return;
+    gpu_profile = enable;
+    if (gpu_timings_mem) return;
+
+    gpu_timings_mem = cast(Mem*, arena_new(mem_root, 4*KB));
+    array_init(&gpu_timings, mem_root);
+
+    for (U64 i = 0; i < GPU_QUERY_FRAMES; ++i) {
+        GpuQueryFrame *f = &gpu_query_frames[i];
+        f->mem = cast(Mem*, arena_new(mem_root, 4*KB));
+        array_init(&f->queries, mem_root);
+        array_init(&f->timings, mem_root);
+    }
+}
 
-    U32 texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
-    if (out_texture) *out_texture = texture;
+Void dr_label (String label) {
+    if (!gpu_profile || (recorder->label && str_match(str(recorder->label), label))) return;
+    dr_flush_vertices();
+    recorder->label = cstr(recorder->mem, label);
+}
 
-    if (! only_color_attach) {
-        U32 rbo;
-        glGenRenderbuffers(1, &rbo);
-        glBindRenderbuffer(GL_RENDERBUFFER, rbo);
-        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, w, h);
-        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo);
+SliceDrGpuTiming dr_get_gpu_timings () {
+    return gpu_timings.as_slice;
+}
+
+static Void gpu_query_begin (DrPass pass, CString label) {
+    if (! gpu_profile) return;
+
+    GpuQueryFrame *f = &gpu_query_frames[gpu_query_frame % GPU_QUERY_FRAMES];
+
+    if (f->count == f->queries.count) {
+        U32 id;
+        glCreateQueries(GL_TIME_ELAPSED, 1, &id);
+        array_push(&f->queries, id);
     }
 
-    assert_always(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    return r;
+    String l = label ? str_copy(f->mem, str(label)) : (String){};
+    array_push_lit(&f->timings, .pass=pass, .label=l);
+    glBeginQuery(GL_TIME_ELAPSED, array_get(&f->queries, f->count++));
+}
+
+static Void gpu_query_end () {
+    if (gpu_profile) glEndQuery(GL_TIME_ELAPSED);
+}
+
+// Reads back the set about to be reused. Since it's the oldest
+// one, the results are the latest that are available.
+static Void gpu_frame_begin () {
+    GpuQueryFrame *f = &gpu_query_frames[gpu_query_frame % GPU_QUERY_FRAMES];
+    if (! gpu_profile && ! f->pending) return;
+
+    // Queries finish in order, so if the last one is available
+    // all of them are.
+    U32 available = false;
+    if (f->pending) glGetQueryObjectuiv(array_get(&f->queries, f->count - 1), GL_QUERY_RESULT_AVAILABLE, &available);
+
+    if (available) {
+        arena_pop_all(cast(Arena*, gpu_timings_mem));
+        gpu_timings.count = 0;
+
+        array_iter (t, &f->timings, *) {
+            U64 ns = 0;
+            glGetQueryObjectui64v(array_get(&f->queries, ARRAY_IDX), GL_QUERY_RESULT, &ns);
+            array_push_lit(&gpu_timings, .pass=t->pass, .label=str_copy(gpu_timings_mem, t->label), .ms=ns / 1e6);
+        }
+
+        gpu_timings_logged = false;
+    }
+
+    f->count = 0;
+    f->timings.count = 0;
+    f->pending = false;
+    arena_pop_all(cast(Arena*, f->mem));
+}
+
+static Void gpu_frame_end () {
+    GpuQueryFrame *f = &gpu_query_frames[gpu_query_frame % GPU_QUERY_FRAMES];
+    if (! f->count) return;
+    f->pending = true;
+    gpu_query_frame++;
+}
+
+istruct (GpuLabelTime) {
+    String label;
+    DrPass pass;
+    U32 count;
+    F64 ms;
+};
+
+static Int cmp_gpu_label_time (Void *A, Void *B) {
+    GpuLabelTime *a = A;
+    GpuLabelTime *b = B;
+    return (a->ms < b->ms) ? 1 : (a->ms == b->ms) ? 0 : -1;
 }
 
-static U32 shader_compile (GLenum type, String filepath) {
+Void dr_log_gpu_timings () {
+    if (gpu_timings_logged || !gpu_timings.count) return;
+    gpu_timings_logged = true;
+
     tmem_new(tm);
 
-    String source = fs_read_entire_file(tm, filepath, 0);
-    if (! source.data) error_fmt("Unable to read file: %.*s\n", STR(filepath));
+    CString pass_names[DR_PASS_COUNT] = { "rects", "glyphs", "blur", "composite" };
+    F64 pass_ms[DR_PASS_COUNT] = {};
+    U32 pass_count[DR_PASS_COUNT] = {};
+    F64 total = 0;
 
-    U32 shader = glCreateShader(type);
+    // The passes of the same label and kind are summed up.
+    Array(GpuLabelTime) by_label;
+    array_init(&by_label, tm);
 
-    glShaderSource(shader, 1, cast(const GLchar**, &source.data), 0);
-    glCompileShader(shader);
+    array_iter (t, &gpu_timings, *) {
+        pass_ms[t->pass] += t->ms;
+        pass_count[t->pass]++;
+        total += t->ms;
 
-    Int success; glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-    if (! success) {
-        log_msg(msg, LOG_ERROR, "", 1);
-        Int count; glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &count);
-        astr_push_fmt(msg, "Shader compilation error: %.*s\n  ", STR(filepath));
-        U32 offset = msg->count;
-        array_increase_count(msg, cast(U32, count), false);
-        glGetShaderInfoLog(shader, count, 0, msg->data + offset);
-        msg->count--; // Get rid of the NUL byte...
-        error();
+        GpuLabelTime *l = array_find_ref(&by_label, (IT->pass == t->pass) && str_match(IT->label, t->label));
+        if (! l) {
+            l = array_push_slot(&by_label);
+            *l = (GpuLabelTime){ .label=t->label, .pass=t->pass };
+        }
+
+        l->count++;
+        l->ms += t->ms;
     }
 
-    return shader;
+    array_sort_cmp(&by_label, cmp_gpu_label_time);
+
+    log_msg(m, LOG_NOTE, "Win", 1);
+    astr_push_fmt(m, "GPU frame: %.3fms in %" PRIu64 " passes\n", total, gpu_timings.count);
+
+    for (U64 i = 0; i < DR_PASS_COUNT; ++i) {
+        if (pass_count[i]) astr_push_fmt(m, "  %-10s %8.3fms %5u passes\n", pass_names[i], pass_ms[i], pass_count[i]);
+    }
+
+    astr_push_cstr(m, "  Most expensive:\n");
+    array_iter (l, &by_label, *) {
+        if (ARRAY_IDX == 10) break;
+        String label = l->label.count ? l->label : str("(none)");
+        astr_push_fmt(m, "    %8.3fms %-10s %5u passes  %.*s\n", l->ms, pass_names[l->pass], l->count, STR(label));
+    }
 }
 
-static U32 shader_new (CString vshader_path, CString fshader_path) {
-    U32 id      = glCreateProgram();
-    U32 vshader = shader_compile(GL_VERTEX_SHADER, str(vshader_path));
-    U32 fshader = shader_compile(GL_FRAGMENT_SHADER, str(fshader_path));
+// =============================================================================
+// Direct rendering:
+// -----------------
+//
+// Normally the frame is drawn into frame_target, which the blurs
+// read from and which keeps the image of the last frame so that
+// only the damage has to be redrawn, and then it's copied to the
+// window. If a frame has no blurs and has to redraw most of the
+// window anyway, retaining the image buys little, so the frame is
+// drawn straight into the default framebuffer which saves the
+// copy: a full-window read and write.
+//
+// After such a frame frame_target is stale, so the next frame that
+// goes through it redraws everything.
+// =============================================================================
+#define DIRECT_MIN_DAMAGE 0.5f // Fraction of the window.
+
+Bool frame_is_direct; // Set by submit_frame() for present_frame().
+Bool frame_target_stale;
+
+static Bool frame_has_blur () {
+    array_iter (cmd, &main_recorder.cmds, *) if (cmd->tag == DR_CMD_BLUR) return true;
+    return false;
+}
 
-    glAttachShader(id, vshader);
-    glAttachShader(id, fshader);
-    glLinkProgram(id);
+// Replays the commands recorded during the frame. Only the
+// damaged area of the framebuffer is cleared and redrawn while
+// the rest keeps what previous frames drew there.
+static Void submit_frame () {
+    dr_flush_vertices();
+    sort_cmds();
 
-    Int success; glGetProgramiv(id, GL_LINK_STATUS, &success);
-    if (! success) {
-        log_msg(msg, LOG_ERROR, "", 1);
-        Int count; glGetProgramiv(id, GL_INFO_LOG_LENGTH, &count);
-        astr_push_cstr(msg, "Shader prog link error.\n  ");
-        U32 offset = msg->count;
-        array_increase_count(msg, cast(U32, count), false);
-        glGetProgramInfoLog(id, count, 0, msg->data + offset);
-        msg->count--; // Get rid of the NUL byte...
-        error();
+    Rect d = (damage_was_set && !damage_everything) ? damage : (Rect){ 0, 0, win_width, win_height };
+    Rect visible = rect_intersect(d, (Rect){ 0, 0, win_width, win_height });
+    frame_is_direct = (visible.w * visible.h >= DIRECT_MIN_DAMAGE * win_width * win_height) && !frame_has_blur();
+
+    if (frame_is_direct || frame_target_stale) d = (Rect){ 0, 0, win_width, win_height };
+    frame_target_stale = frame_is_direct;
+    if (frame_is_direct) frame_stats.frames_direct++;
+
+    Int x0 = clamp(cast(Int, floorf(d.x)), 0, win_width);
+    Int x1 = clamp(cast(Int, ceilf(d.x + d.w)), 0, win_width);
+    Int y0 = clamp(cast(Int, floorf(win_height - d.y - d.h)), 0, win_height);
+    Int y1 = clamp(cast(Int, ceilf(win_height - d.y)), 0, win_height);
+    Int damage_scissor[4] = { x0, y0, max(0, x1 - x0), max(0, y1 - y0) };
+    Bool redraw = damage_scissor[2] && damage_scissor[3];
+
+    gl_bind_framebuffer(GL_FRAMEBUFFER, frame_is_direct ? 0 : frame_target->fbo);
+    gl_viewport(0, 0, win_width, win_height);
+
+    if (redraw) {
+        gl_scissor(damage_scissor[0], damage_scissor[1], damage_scissor[2], damage_scissor[3]);
+        glClearColor(0, 0, 0, 1);
+        glClear(GL_COLOR_BUFFER_BIT);
+        frame_stats.pixels_redrawn = damage_scissor[2] * damage_scissor[3];
     }
 
-    glDeleteShader(vshader);
-    glDeleteShader(fshader);
+    Rect scissor = { 0, 0, win_width, win_height };
+    blur_capture.valid = false;
+    gpu_frame_begin();
+
+    array_iter (cmd, &main_recorder.cmds, *) {
+        switch (cmd->tag) {
+        case DR_CMD_TEXTURE_UPDATE: {
+            Auto u = &cmd->texture_update;
+            glTextureSubImage2D(u->texture, 0, u->x, u->y, u->w, u->h, GL_RGBA, GL_UNSIGNED_BYTE, u->buf);
+        } break;
+
+        case DR_CMD_SCISSOR: {
+            scissor = cmd->scissor;
+            if (redraw) scissor_within_damage(scissor, damage_scissor);
+        } break;
+
+        case DR_CMD_BLUR: {
+            if (! redraw) break;
+            if (! rects_overlap(cmd->blur.rect, d)) break;
+            gpu_query_begin(DR_PASS_BLUR, cmd->label);
+            blur(ARRAY_IDX, damage_scissor);
+            gpu_query_end();
+            scissor_within_damage(scissor, damage_scissor);
+        } break;
+
+        case DR_CMD_RECTS: {
+            if (! redraw) break;
+
+            Bool glyphs = (cmd->rects.pipeline == DR_PIPELINE_GLYPHS);
+            Shader *shader = &pipeline_shaders[cmd->rects.pipeline];
+            gl_bind_vao(glyphs ? glyph_VAO : VAO);
+            gl_use_program(shader);
+            set_mat4(shader, "projection", projection);
+            for (U32 i = 0; i < cmd->rects.texture_count; ++i) gl_bind_texture(i, cmd->rects.textures[i]);
+
+            gpu_query_begin(glyphs ? DR_PASS_GLYPHS : DR_PASS_RECTS, cmd->label);
+            glDrawArraysInstancedBaseInstance(GL_TRIANGLE_STRIP, 0, quad_vertices.count, cmd->rects.count, cmd->rects.first);
+            gpu_query_end();
+
+            if (blur_capture.valid) blur_capture.dirty = rect_union(blur_capture.dirty, cmd->rects.bounds);
+
+            if (glyphs) frame_stats.glyphs += cmd->rects.count;
+            else        frame_stats.rects += cmd->rects.count;
+            frame_stats.draw_calls++;
+            frame_stats.bytes_uploaded += cmd->rects.count * instance_size(cmd->rects.pipeline);
+            frame_stats.bytes_uploaded_as_vertices += cmd->rects.count * 6 * FAT_VERTEX_SIZE;
+        } break;
+        }
+    }
 
-    return id;
+    discard_frame();
 }
 
-Void dr_flush_vertices () {
-    glBindVertexArray(VAO);
-    glUseProgram(rect_shader);
-    set_mat4(rect_shader, "projection", projection);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-
-    ATTR(Vertex, 0, 2, position);
-    ATTR(Vertex, 1, 4, color);
-    ATTR(Vertex, 2, 2, top_left);
-    ATTR(Vertex, 3, 2, bottom_right);
-    ATTR(Vertex, 4, 4, radius);
-    ATTR(Vertex, 5, 1, edge_softness);
-    ATTR(Vertex, 6, 4, border_color);
-    ATTR(Vertex, 7, 4, border_widths);
-    ATTR(Vertex, 8, 4, inset_shadow_color);
-    ATTR(Vertex, 9, 4, outset_shadow_color);
-    ATTR(Vertex, 10, 1, outset_shadow_width);
-    ATTR(Vertex, 11, 1, inset_shadow_width);
-    ATTR(Vertex, 12, 2, shadow_offsets);
-    ATTR(Vertex, 13, 2, uv);
-    ATTR(Vertex, 14, 4, text_color);
-    ATTR(Vertex, 15, 1, text_is_grayscale);
-
-    glBufferData(GL_ARRAY_BUFFER, array_size(&vertices), vertices.data, GL_STREAM_DRAW);
-    glDrawArrays(GL_TRIANGLES, 0, vertices.count);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    vertices.count = 0;
-}
-
-Vertex *dr_reserve_vertices (U32 n) {
-    if (vertices.count + n >= VERTEX_MAX_BATCH_SIZE) dr_flush_vertices();
-    SliceVertex slice;
-    array_increase_count_o(&vertices, n, false, &slice);
-    return slice.data;
-}
-
-static Void draw_rect_vertex (Vertex *v, Vec2 pos, Vec2 uv, Vec4 color, RectAttributes *a) {
-    v->position            = pos;
-    v->color               = color;
-    v->top_left            = a->top_left;
-    v->bottom_right        = a->bottom_right;
-    v->radius              = a->radius;
-    v->edge_softness       = a->edge_softness;
-    v->border_color        = a->border_color;
-    v->border_widths       = a->border_widths;
-    v->inset_shadow_color  = a->inset_shadow_color;
-    v->outset_shadow_color = a->outset_shadow_color;
-    v->outset_shadow_width = a->outset_shadow_width;
-    v->inset_shadow_width  = a->inset_shadow_width;
-    v->shadow_offsets      = a->shadow_offsets;
-    v->uv                  = uv;
-    v->text_color          = a->text_color;
-    v->text_is_grayscale   = a->text_is_grayscale;
-}
-
-SliceVertex dr_rect_fn (RectAttributes *a) {
-    Vertex *p = dr_reserve_vertices(6);
+// =============================================================================
+// Frame dumps:
+// ------------
+//
+// For headless golden checks. While one is requested every
+// presented frame is read back into frame_pixels as RGBA rows
+// from the top. When win_run() runs out of work, so nothing is
+// animating and no glyph or image is pending, it writes the last
+// frame to a PNG or compares it with one and returns instead of
+// waiting for input.
+// =============================================================================
+#define GOLDEN_TOLERANCE 8 // Per channel, so rounding differences between drivers are not failures.
+
+static CString frame_dump_path;
+static Bool frame_dump_compare;
+static Bool frame_matched = true;
+static U8 *frame_pixels;
+static Int frame_pixels_width;
+static Int frame_pixels_height;
+
+Void win_dump_frame (CString path) {
+    frame_dump_path = path;
+    frame_dump_compare = false;
+}
 
-    if (a->color2.x == -1.0) a->color2 = a->color;
+Void win_compare_frame (CString path) {
+    frame_dump_path = path;
+    frame_dump_compare = true;
+}
 
-    // We make the rect slightly bigger because the fragment
-    // shader will shrink it to make room for the drop shadow.
-    a->top_left.x     -= 2*a->outset_shadow_width + 2*a->edge_softness;
-    a->top_left.y     -= 2*a->outset_shadow_width + 2*a->edge_softness;
-    a->bottom_right.x += 2*a->outset_shadow_width + 2*a->edge_softness;
-    a->bottom_right.y += 2*a->outset_shadow_width + 2*a->edge_softness;
+Bool win_frame_matched () {
+    return frame_matched;
+}
 
-    a->top_left.y = win_height - a->top_left.y;
-    a->bottom_right.y = win_height - a->bottom_right.y;
+static Void read_frame_pixels () {
+    if (! frame_dump_path) return;
 
-    Vec2 bottom_left = vec2(a->top_left.x, a->bottom_right.y);
-    Vec2 top_right   = vec2(a->bottom_right.x, a->top_left.y);
+    U64 size = cast(U64, win_width) * win_height * 4;
 
-    Vec4 tr = a->texture_rect;
+    if (frame_pixels_width != win_width || frame_pixels_height != win_height) {
+        if (frame_pixels) mem_free(mem_root, .old_ptr=frame_pixels, .old_size=(cast(U64, frame_pixels_width) * frame_pixels_height * 4));
+        frame_pixels = mem_alloc(mem_root, U8, .size=size);
+        frame_pixels_width = win_width;
+        frame_pixels_height = win_height;
+    }
 
-    draw_rect_vertex(&p[0], a->top_left, vec2(tr.x, tr.y), a->color, a);
-    draw_rect_vertex(&p[1], bottom_left, vec2(tr.x, tr.y+tr.w), a->color2, a);
-    draw_rect_vertex(&p[2], a->bottom_right, vec2(tr.x+tr.z, tr.y+tr.w), a->color2, a);
-    draw_rect_vertex(&p[3], a->bottom_right, vec2(tr.x+tr.z, tr.y+tr.w), a->color2, a);
-    draw_rect_vertex(&p[4], top_right, vec2(tr.x+tr.z, tr.y), a->color, a);
-    draw_rect_vertex(&p[5], a->top_left, vec2(tr.x, tr.y), a->color, a);
+    if (software) {
+        U32 stride;
+        U8 *pixels = sw_get_pixels(&stride);
+        SDL_ConvertPixels(win_width, win_height, SDL_PIXELFORMAT_ARGB8888, pixels, stride, SDL_PIXELFORMAT_RGBA32, frame_pixels, win_width * 4);
+    } else {
+        gl_bind_framebuffer(GL_FRAMEBUFFER, 0);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadnPixels(0, 0, win_width, win_height, GL_RGBA, GL_UNSIGNED_BYTE, size, frame_pixels);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+        // GL rows go from the bottom.
+        tmem_new(tm);
+        U64 row_size = cast(U64, win_width) * 4;
+        U8 *tmp = mem_alloc(tm, U8, .size=row_size);
+
+        for (Int y = 0; y < win_height / 2; ++y) {
+            U8 *a = frame_pixels + y * row_size;
+            U8 *b = frame_pixels + (win_height - 1 - y) * row_size;
+            memcpy(tmp, a, row_size);
+            memcpy(a, b, row_size);
+            memcpy(b, tmp, row_size);
+        }
+    }
 
-    return (SliceVertex){p,6};
+    // The window is opaque whatever ended up in the alpha channel.
+    for (U64 i = 3; i < size; i += 4) frame_pixels[i] = 255;
 }
 
-Void dr_blur (Rect r, F32 strength, Vec4 corner_radius) {
-    dr_flush_vertices();
-    glScissor(0, 0, win_width, win_height);
+static Bool frame_dump_ready () {
+    return frame_pixels && !font_get_atlas_stats(ui->font_cache).pending && !image_stats.pending;
+}
 
-    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, blur_buffer1);
-    glBlitFramebuffer(0, 0, win_width, win_height, 0, 0, win_width/BLUR_SHRINK, win_height/BLUR_SHRINK, GL_COLOR_BUFFER_BIT, GL_LINEAR);
-    glViewport(0, 0, win_width/BLUR_SHRINK, win_height/BLUR_SHRINK);
+static Void finish_frame_dump () {
+    Int w = frame_pixels_width;
+    Int h = frame_pixels_height;
 
-    blur_vertices.count = 0;
-    array_push_lit(&blur_vertices, -1.0f,  1.0f);
-    array_push_lit(&blur_vertices, -1.0f, -1.0f);
-    array_push_lit(&blur_vertices,  1.0f, -1.0f);
-    array_push_lit(&blur_vertices, -1.0f,  1.0f);
-    array_push_lit(&blur_vertices,  1.0f, -1.0f);
-    array_push_lit(&blur_vertices,  1.0f,  1.0f);
-
-    glBindVertexArray(blur_VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, blur_VBO);
-    ATTR(AElem(&blur_vertices), 0, 2, pos);
-    glBufferData(GL_ARRAY_BUFFER, array_size(&blur_vertices), blur_vertices.data, GL_STREAM_DRAW);
-
-    glUseProgram(blur_shader);
-    set_int(blur_shader, "blur_radius", strength);
-    set_bool(blur_shader, "do_blurring", true);
-    set_mat4(blur_shader, "projection", mat4(1));
-
-    for (U64 i = 0; i < 3; ++i) {
-        glBindFramebuffer(GL_FRAMEBUFFER, blur_buffer2);
-        glBindTexture(GL_TEXTURE_2D, blur_tex1);
-        set_bool(blur_shader, "horizontal", true);
-        glDrawArrays(GL_TRIANGLES, 0, blur_vertices.count);
-
-        glBindFramebuffer(GL_FRAMEBUFFER, blur_buffer1);
-        glBindTexture(GL_TEXTURE_2D, blur_tex2);
-        set_bool(blur_shader, "horizontal", false);
-        glDrawArrays(GL_TRIANGLES, 0, blur_vertices.count);
-    }
-
-    glViewport(0, 0, win_width, win_height);
-    glBindTexture(GL_TEXTURE_2D, blur_tex1);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    if (! frame_dump_compare) {
+        if (! stbi_write_png(frame_dump_path, w, h, 4, frame_pixels, w * 4)) {
+            log_msg_fmt(LOG_ERROR, "Win", 1, "Couldn't write frame to file: %s", frame_dump_path);
+            frame_matched = false;
+        }
 
-    r.y = win_height - r.y;
-    blur_vertices.count = 0;
-    array_push_lit(&blur_vertices, r.x, r.y);
-    array_push_lit(&blur_vertices, r.x+r.w, r.y);
-    array_push_lit(&blur_vertices, r.x, r.y-r.h);
-    array_push_lit(&blur_vertices, r.x, r.y-r.h);
-    array_push_lit(&blur_vertices, r.x+r.w, r.y);
-    array_push_lit(&blur_vertices, r.x+r.w, r.y-r.h);
-
-    set_mat4(blur_shader, "projection", projection);
-    set_bool(blur_shader, "do_blurring", false);
-    set_vec2(blur_shader, "half_size", vec2(r.w/2, r.h/2));
-    set_vec2(blur_shader, "center", vec2(r.x+r.w/2, r.y-r.h/2));
-    set_vec4(blur_shader, "radius", corner_radius);
-    set_float(blur_shader, "blur_shrink", BLUR_SHRINK);
-
-    glBufferData(GL_ARRAY_BUFFER, array_size(&blur_vertices), blur_vertices.data, GL_STREAM_DRAW);
-    glDrawArrays(GL_TRIANGLES, 0, blur_vertices.count);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-}
+        return;
+    }
 
-Void dr_scissor (Rect r) {
-    glScissor(r.x, r.y, r.w, r.h);
+    Int gw, gh, n;
+    stbi_set_flip_vertically_on_load_thread(false);
+    U8 *golden = stbi_load(frame_dump_path, &gw, &gh, &n, 4);
+
+    if (! golden) {
+        log_msg_fmt(LOG_ERROR, "Win", 1, "Couldn't load golden frame from file: %s", frame_dump_path);
+        frame_matched = false;
+        return;
+    }
+
+    if (gw != w || gh != h) {
+        log_msg_fmt(LOG_ERROR, "Win", 1, "The frame is %ix%i but the golden frame in %s is %ix%i.", w, h, frame_dump_path, gw, gh);
+        frame_matched = false;
+    } else {
+        U64 differing = 0;
+        Int max_delta = 0;
+
+        for (U64 i = 0; i < cast(U64, w) * h * 4; i += 4) {
+            Int delta = 0;
+            for (U64 c = 0; c < 3; ++c) delta = max(delta, abs(frame_pixels[i + c] - golden[i + c]));
+            if (delta > GOLDEN_TOLERANCE) differing++;
+            max_delta = max(max_delta, delta);
+        }
+
+        if (differing) {
+            log_msg_fmt(LOG_ERROR, "Win", 1, "%" PRIu64 " pixels differ from the golden frame in %s by more than %i (by up to %i).", differing, frame_dump_path, GOLDEN_TOLERANCE, max_delta);
+            frame_matched = false;
+        }
+    }
+
+    stbi_image_free(golden);
 }
 
-Texture dr_image (CString filepath, Bool flip) {
-    U32 id;
-    glGenTextures(1, &id);
-    glBindTexture(GL_TEXTURE_2D, id);
-    glTextureParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTextureParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTextureParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTextureParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+static Void present_frame () {
+    if (frame_is_direct) {
+        gpu_frame_end();
+        read_frame_pixels();
+        SDL_GL_SwapWindow(window);
+        return;
+    }
 
-    stbi_set_flip_vertically_on_load(flip);
+    // The frame target covers the whole window and was cleared the
+    // same way as the window is in a direct frame, so it's copied
+    // as is rather than blended over anything. That way a frame
+    // looks the same whichever path it took.
+    gl_bind_framebuffer(GL_FRAMEBUFFER, 0);
+    gl_scissor(0, 0, win_width, win_height);
+    gl_use_program(&screen_shader);
+    gl_bind_vao(screen_VAO);
+    gl_bind_texture(0, frame_target->texture);
+    set_vec2(&screen_shader, "uv_scale", vec2(cast(F32, win_width) / frame_target->width, cast(F32, win_height) / frame_target->height));
+    glDisable(GL_BLEND);
+    gpu_query_begin(DR_PASS_COMPOSITE, 0);
+    glDrawArrays(GL_TRIANGLES, 0, screen_vertices.count);
+    gpu_query_end();
+    glEnable(GL_BLEND);
+    gpu_frame_end();
+
+    read_frame_pixels();
+    SDL_GL_SwapWindow(window);
+}
 
-    Int w, h, n; U8 *data = stbi_load(filepath, &w, &h, &n, 0);
-    if (! data) error_fmt("Couldn't load image from file: %s\n", filepath);
+// =============================================================================
+// Software backend:
+// -----------------
+//
+// The same replay as submit_frame() and present_frame() but on
+// the rasterizer from software.c. The clip rects handed to it
+// are in window coordinates and always within the damage.
+// =============================================================================
+static Void clip_within_damage (Rect r, Int *d, Int *out) {
+    Int x0 = max(cast(Int, r.x), d[0]);
+    Int y0 = max(cast(Int, r.y), d[1]);
+    Int x1 = min(cast(Int, r.x) + cast(Int, r.w), d[0] + d[2]);
+    Int y1 = min(cast(Int, r.y) + cast(Int, r.h), d[1] + d[3]);
+    out[0] = x0;
+    out[1] = y0;
+    out[2] = max(0, x1 - x0);
+    out[3] = max(0, y1 - y0);
+}
 
-    Int fmt = (n == 3) ? GL_RGB : GL_RGBA;
-    glTexImage2D(GL_TEXTURE_2D, 0, fmt, w, h, 0, fmt, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
+// The rasterizer only knows about rects, so glyphs are turned
+// into textured rects for it. They are allocated in the mem of
+// the main recorder since sw_rects() holds on to them until the
+// next sw_flush().
+static RectInstance *glyphs_to_rects (GlyphInstance *glyphs, U32 count) {
+    RectInstance *rects = mem_alloc(main_recorder.mem, RectInstance, .zeroed=true, .size=(count * sizeof(RectInstance)));
+
+    for (U32 i = 0; i < count; ++i) {
+        GlyphInstance *g = &glyphs[i];
+        RectInstance *r  = &rects[i];
+        r->top_left          = g->top_left;
+        r->bottom_right      = (Vec2){ g->top_left.x + g->atlas_rect[2], g->top_left.y - g->atlas_rect[3] };
+        r->texture_rect      = (Vec4){ g->atlas_rect[0], g->atlas_rect[1], g->atlas_rect[2], g->atlas_rect[3] };
+        r->text_color        = g->color;
+        r->text_is_grayscale = (g->flags & GLYPH_GRAYSCALE) ? 1 : 0;
+        r->texture_slot      = g->flags & 0xff;
+    }
 
-    stbi_image_free(data);
-    return (Texture){ .id=id, .width=w, .height=h };
+    return rects;
 }
 
-Void dr_bind_texture (Texture *texture) {
-    glBindTexture(GL_TEXTURE_2D, texture->id);
+static Void submit_frame_sw () {
+    dr_flush_vertices();
+    sort_cmds();
+
+    Rect d = (damage_was_set && !damage_everything) ? damage : (Rect){ 0, 0, win_width, win_height };
+    Int x0 = clamp(cast(Int, floorf(d.x)), 0, win_width);
+    Int x1 = clamp(cast(Int, ceilf(d.x + d.w)), 0, win_width);
+    Int y0 = clamp(cast(Int, floorf(d.y)), 0, win_height);
+    Int y1 = clamp(cast(Int, ceilf(d.y + d.h)), 0, win_height);
+    Int damage_clip[4] = { x0, y0, max(0, x1 - x0), max(0, y1 - y0) };
+    Bool redraw = damage_clip[2] && damage_clip[3];
+
+    if (redraw) {
+        sw_clear(damage_clip);
+        frame_stats.pixels_redrawn = damage_clip[2] * damage_clip[3];
+    }
+
+    Int clip[4];
+    memcpy(clip, damage_clip, sizeof(clip));
+
+    array_iter (cmd, &main_recorder.cmds, *) {
+        switch (cmd->tag) {
+        case DR_CMD_TEXTURE_UPDATE: {
+            Auto u = &cmd->texture_update;
+            sw_texture_update(u->texture, u->x, u->y, u->w, u->h, u->buf);
+        } break;
+
+        case DR_CMD_SCISSOR: {
+            Rect s = cmd->scissor;
+            s.y = win_height - s.y - s.h;
+            clip_within_damage(s, damage_clip, clip);
+        } break;
+
+        case DR_CMD_BLUR: {
+            if (! redraw) break;
+            if (! rects_overlap(cmd->blur.rect, d)) break;
+            U32 radius = 1 << (blur_levels(cmd->blur.strength) - 1);
+            sw_blur(cmd->blur.rect, radius, cmd->blur.corner_radius, damage_clip);
+        } break;
+
+        case DR_CMD_RECTS: {
+            if (! redraw) break;
+            Void *instances = &ring.data[cmd->rects.first * instance_size(cmd->rects.pipeline)];
+
+            if (cmd->rects.pipeline == DR_PIPELINE_GLYPHS) {
+                sw_rects(glyphs_to_rects(instances, cmd->rects.count), cmd->rects.count, cmd->rects.textures, cmd->rects.texture_count, clip);
+                frame_stats.glyphs += cmd->rects.count;
+            } else {
+                sw_rects(instances, cmd->rects.count, cmd->rects.textures, cmd->rects.texture_count, clip);
+                frame_stats.rects += cmd->rects.count;
+            }
+
+            frame_stats.draw_calls++;
+        } break;
+        }
+    }
+
+    sw_flush();
+    discard_frame();
 }
 
-Texture dr_2d_texture_alloc (U32 width, U32 height) {
-    U32 id;
-    glGenTextures(1, &id);
-    glBindTexture(GL_TEXTURE_2D, id);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    return (Texture){.id=id, .width=width, .height=height};
+static Void present_frame_sw () {
+    SDL_Surface *surface = SDL_GetWindowSurface(window);
+    if (! surface) return;
+
+    U32 stride;
+    U8 *pixels = sw_get_pixels(&stride);
+    Int w = min(win_width, surface->w);
+    Int h = min(win_height, surface->h);
+    SDL_ConvertPixels(w, h, SDL_PIXELFORMAT_ARGB8888, pixels, stride, surface->format, surface->pixels, surface->pitch);
+    read_frame_pixels();
+    SDL_UpdateWindowSurface(window);
 }
 
-Void dr_2d_texture_update (Texture *texture, U32 x, U32 y, U32 w, U32 h, U8 *buf) {
-    glBindTexture(GL_TEXTURE_2D, texture->id);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, buf);
+DrFrameStats *dr_get_frame_stats () {
+    return &last_frame_stats;
 }
 
 Void win_set_cursor (MouseCursor cursor) {
@@ -373,6 +2446,12 @@ Vec2 win_get_size () {
     return vec2(win_width, win_height);
 }
 
+Void win_wake () {
+    SDL_Event event = {};
+    event.type = wake_event;
+    SDL_PushEvent(&event);
+}
+
 SliceEvent *win_get_events () {
     return &events.as_slice;
 }
@@ -471,6 +2550,109 @@ static Key convert_scancode (SDL_Scancode scancode) {
     }
 }
 
+// =============================================================================
+// Frame pacing:
+// -------------
+//
+// While the ui is animating or settling after input the loop is
+// paced to the refresh rate of the display. Rather than building
+// the next frame right after the swap, it sleeps until the latest
+// point from which the frame can still make the next vblank, so
+// that the build sees the freshest input. That point is the next
+// vblank minus a decaying maximum of recent build and submit
+// times and a safety margin.
+//
+// Vblanks are predicted from when the last swap returned, which
+// with vsync is right after one. The software backend has no
+// vsync, so there the pacer itself sets the phase.
+// =============================================================================
+#define PACER_MARGIN          (1*1000*1000) // In ns.
+#define PACER_DEFAULT_REFRESH 60.0f
+
+istruct (Pacer) {
+    U64 period; // Of the display refresh in ns.
+    U64 last_present;
+    U64 work_estimate; // Time from build to swap in ns.
+    FrameTiming current;
+    FrameTiming history[WIN_TIMING_HISTORY];
+    U64 history_count; // Total number of frames recorded.
+};
+
+Pacer pacer;
+
+static Void pacer_init () {
+    const SDL_DisplayMode *mode = SDL_GetCurrentDisplayMode(SDL_GetDisplayForWindow(window));
+    F32 refresh = (mode && mode->refresh_rate > 0) ? mode->refresh_rate : PACER_DEFAULT_REFRESH;
+    pacer.period = cast(U64, 1e9 / refresh);
+}
+
+static Void pacer_wait () {
+    if (! pacer.last_present) return;
+
+    U64 now     = SDL_GetTicksNS();
+    U64 lead    = pacer.work_estimate + PACER_MARGIN;
+    U64 vblanks = (now + lead - pacer.last_present) / pacer.period + 1;
+    U64 wake    = pacer.last_present + vblanks*pacer.period - lead;
+
+    if (wake > now) SDL_DelayNS(wake - now);
+}
+
+static Void pacer_event (SDL_Event *event) {
+    U64 t = event->common.timestamp ?: SDL_GetTicksNS();
+    if (!pacer.current.event || t < pacer.current.event) pacer.current.event = t;
+}
+
+// The work is measured up to the swap since with vsync the swap
+// itself blocks until the vblank.
+static Void pacer_frame_end (U64 work_end, Bool presented) {
+    U64 work = work_end - pacer.current.build;
+    pacer.work_estimate = max(work, pacer.work_estimate - pacer.work_estimate/16);
+
+    if (presented) {
+        pacer.current.present = SDL_GetTicksNS();
+        pacer.last_present = pacer.current.present;
+    }
+
+    pacer.history[pacer.history_count++ % WIN_TIMING_HISTORY] = pacer.current;
+    pacer.current = (FrameTiming){};
+}
+
+FrameTiming win_get_frame_timing () {
+    if (! pacer.history_count) return (FrameTiming){};
+    return pacer.history[(pacer.history_count - 1) % WIN_TIMING_HISTORY];
+}
+
+FrameLatency win_get_latency () {
+    tmem_new(tm);
+
+    Array(U64) samples;
+    array_init(&samples, tm);
+
+    U64 count = min(pacer.history_count, WIN_TIMING_HISTORY);
+    for (U64 i = 0; i < count; ++i) {
+        FrameTiming *t = &pacer.history[i];
+        if (t->event && t->present) array_push(&samples, t->present - t->event);
+    }
+
+    FrameLatency result = { .samples=samples.count };
+    if (! samples.count) return result;
+
+    array_sort_cmp(&samples, uarray_cmp_u64);
+    result.p50 = array_get(&samples, samples.count*50/100) / 1e6;
+    result.p90 = array_get(&samples, samples.count*90/100) / 1e6;
+    result.p99 = array_get(&samples, samples.count*99/100) / 1e6;
+    return result;
+}
+
+// Only events that turn into ui events count as input.
+static Void process_event (SDL_Event *, Bool *);
+
+static Void handle_event (SDL_Event *event, Bool *running) {
+    U64 count = events.count;
+    process_event(event, running);
+    if (events.count > count) pacer_event(event);
+}
+
 static Void process_event (SDL_Event *event, Bool *running) {
     switch (event->type) {
     case SDL_EVENT_QUIT: {
@@ -485,18 +2667,17 @@ static Void process_event (SDL_Event *event, Bool *running) {
         win_height = height;
 
         update_projection();
-        glViewport(0, 0, width, height);
-
-        framebuffer = framebuffer_new(&framebuffer_tex, 1, win_width, win_height);
-        blur_buffer1 = framebuffer_new(&blur_tex1, 1, floor(win_width  / BLUR_SHRINK), floor(win_height / BLUR_SHRINK));
-        blur_buffer2 = framebuffer_new(&blur_tex2, 1, floor(win_width  / BLUR_SHRINK), floor(win_height / BLUR_SHRINK));
-
-        glScissor(0, 0, width, height);
+        resize_pending = true;
+        present_needed = true;
 
         Auto e = array_push_slot(&events);
         e->tag = EVENT_WINDOW_SIZE;
     } break;
 
+    case SDL_EVENT_WINDOW_EXPOSED: {
+        present_needed = true;
+    } break;
+
     case SDL_EVENT_MOUSE_WHEEL: {
         Auto e = array_push_slot(&events);
         e->tag = EVENT_SCROLL;
@@ -538,35 +2719,94 @@ static Void process_event (SDL_Event *event, Bool *running) {
 }
 }
 
-Void win_init (CString title) {
-    SDL_Init(SDL_INIT_VIDEO);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 5);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
-    window = SDL_CreateWindow(title, win_width, win_height, SDL_WINDOW_OPENGL|SDL_WINDOW_RESIZABLE);
-    gl_ctx = SDL_GL_CreateContext(window);
-    gladLoadGLLoader((GLADloadproc)SDL_GL_GetProcAddress);
-    SDL_StartTextInput(window);
-
+static Void gl_init () {
     glDisable(GL_DEPTH_TEST);
     glDisable(GL_CULL_FACE);
     glEnable(GL_BLEND);
     glEnable(GL_SCISSOR_TEST);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
+    // The destination alpha is blended so that it stays 1 over an
+    // opaque clear, rather than ending up as a*a + (1-a). The frame
+    // target has no alpha, but the window's framebuffer that direct
+    // frames draw into may have one that the compositor looks at.
+    glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+    gl_state.scissor[2]  = -1;
+    gl_state.viewport[2] = -1;
+    gl_viewport(0, 0, win_width, win_height);
+
+    { // Rect init:
+        array_init(&quad_vertices, mem_root);
+        array_push_lit(&quad_vertices, .corner={0.0f, 1.0f});
+        array_push_lit(&quad_vertices, .corner={0.0f, 0.0f});
+        array_push_lit(&quad_vertices, .corner={1.0f, 1.0f});
+        array_push_lit(&quad_vertices, .corner={1.0f, 0.0f});
+
+        glCreateBuffers(1, &quad_VBO);
+        glNamedBufferStorage(quad_VBO, array_size(&quad_vertices), quad_vertices.data, 0);
+
+        glCreateVertexArrays(1, &VAO);
+        glVertexArrayVertexBuffer(VAO, 0, quad_VBO, 0, sizeof(AElem(&quad_vertices)));
+        glVertexArrayVertexBuffer(VAO, 1, ring.id, 0, sizeof(RectInstance));
+        glVertexArrayBindingDivisor(VAO, 1, 1);
+
+        ATTR(VAO, 0, AElem(&quad_vertices), 0, 2, corner);
+        ATTR(VAO, 1, RectInstance, 1, 4, top_left); // Includes bottom_right.
+        ATTR(VAO, 1, RectInstance, 2, 4, radius);
+        ATTR(VAO, 1, RectInstance, 3, 4, border_widths);
+        ATTR(VAO, 1, RectInstance, 4, 4, texture_rect);
+        ATTR(VAO, 1, RectInstance, 5, 2, shadow_offsets);
+        ATTR(VAO, 1, RectInstance, 6, 1, edge_softness);
+        ATTR(VAO, 1, RectInstance, 7, 1, outset_shadow_width);
+        ATTR(VAO, 1, RectInstance, 8, 1, inset_shadow_width);
+        ATTR(VAO, 1, RectInstance, 9, 1, text_is_grayscale);
+        ATTR_U32(VAO, 1, RectInstance, 10, 4, colors);
+        ATTR_U32(VAO, 1, RectInstance, 11, 4, border_color); // Includes the other 3 colors.
+        ATTR_U32(VAO, 1, RectInstance, 12, 1, texture_slot);
+    }
 
-    for (U32 c = SDL_SYSTEM_CURSOR_DEFAULT; c < SDL_SYSTEM_CURSOR_COUNT; ++c) {
-        cursors[c] = SDL_CreateSystemCursor(c);
+    { // Glyph init:
+        glCreateVertexArrays(1, &glyph_VAO);
+        glVertexArrayVertexBuffer(glyph_VAO, 0, quad_VBO, 0, sizeof(AElem(&quad_vertices)));
+        glVertexArrayVertexBuffer(glyph_VAO, 1, ring.id, 0, sizeof(GlyphInstance));
+        glVertexArrayBindingDivisor(glyph_VAO, 1, 1);
+
+        ATTR(glyph_VAO, 0, AElem(&quad_vertices), 0, 2, corner);
+        ATTR(glyph_VAO, 1, GlyphInstance, 1, 2, top_left);
+        ATTR_U16(glyph_VAO, 1, GlyphInstance, 2, 4, atlas_rect);
+        ATTR_U32(glyph_VAO, 1, GlyphInstance, 3, 1, color);
+        ATTR_U32(glyph_VAO, 1, GlyphInstance, 4, 1, flags);
+    }
+
+    program_cache_init();
+
+    CString rect_shader_defines[] = {
+        [DR_PIPELINE_TEXTURED] = "#define VARIANT_TEXTURED\n",
+        [DR_PIPELINE_FLAT]     = "#define VARIANT_FLAT\n",
+        [DR_PIPELINE_ROUNDED]  = "#define VARIANT_ROUNDED\n",
+        [DR_PIPELINE_FULL]     = "#define VARIANT_FULL\n",
+    };
+
+    Int units[MAX_TEXTURE_UNITS];
+    for (Int i = 0; i < MAX_TEXTURE_UNITS; ++i) units[i] = i;
+
+    for (U64 i = 0; i < DR_PIPELINE_COUNT; ++i) {
+        Shader *s = &pipeline_shaders[i];
+
+        if (i == DR_PIPELINE_GLYPHS) {
+            s->id = shader_new("src/window/shaders/glyph_vs.glsl", "src/window/shaders/glyph_fs.glsl", "");
+        } else {
+            s->id = shader_new("src/window/shaders/rect_vs.glsl", "src/window/shaders/rect_fs.glsl", rect_shader_defines[i]);
+        }
+
+        Int loc = glGetUniformLocation(s->id, "textures");
+        if (loc != -1) glProgramUniform1iv(s->id, loc, MAX_TEXTURE_UNITS, units);
     }
 
-    framebuffer   = framebuffer_new(&framebuffer_tex, 1, win_width, win_height);
-    blur_buffer1  = framebuffer_new(&blur_tex1, 1, floor(win_width/BLUR_SHRINK), floor(win_height/BLUR_SHRINK));
-    blur_buffer2  = framebuffer_new(&blur_tex2, 1, floor(win_width/BLUR_SHRINK), floor(win_height/BLUR_SHRINK));
-    rect_shader   = shader_new("src/window/shaders/rect_vs.glsl", "src/window/shaders/rect_fs.glsl");
-    screen_shader = shader_new("src/window/shaders/screen_vs.glsl", "src/window/shaders/screen_fs.glsl");
-    blur_shader   = shader_new("src/window/shaders/blur_vs.glsl", "src/window/shaders/blur_fs.glsl");
+    screen_shader.id = shader_new("src/window/shaders/screen_vs.glsl", "src/window/shaders/screen_fs.glsl", "");
+    blur_shader.id   = shader_new("src/window/shaders/blur_vs.glsl", "src/window/shaders/blur_fs.glsl", "");
+    program_cache_prune();
+    program_cache_log();
 
     { // Screen quad init:
         array_init(&screen_vertices, mem_root);
@@ -577,28 +2817,68 @@ Void win_init (CString title) {
         array_push_lit(&screen_vertices, .pos={ 1.0f, -1.0f},  .tex={1.0f, 0.0f});
         array_push_lit(&screen_vertices, .pos={ 1.0f,  1.0f},  .tex={1.0f, 1.0f});
 
-        glGenVertexArrays(1, &screen_VAO);
-        glGenBuffers(1, &screen_VBO);
-        glBindVertexArray(screen_VAO);
-        glBindBuffer(GL_ARRAY_BUFFER, screen_VBO);
-        glBufferData(GL_ARRAY_BUFFER, array_size(&screen_vertices), screen_vertices.data, GL_STATIC_DRAW);
-        ATTR(AElem(&screen_vertices), 0, 2, pos);
-        ATTR(AElem(&screen_vertices), 1, 2, tex);
+        glCreateBuffers(1, &screen_VBO);
+        glNamedBufferStorage(screen_VBO, array_size(&screen_vertices), screen_vertices.data, 0);
+
+        glCreateVertexArrays(1, &screen_VAO);
+        glVertexArrayVertexBuffer(screen_VAO, 0, screen_VBO, 0, sizeof(AElem(&screen_vertices)));
+        ATTR(screen_VAO, 0, AElem(&screen_vertices), 0, 2, pos);
+        ATTR(screen_VAO, 0, AElem(&screen_vertices), 1, 2, tex);
+
+        set_int(&screen_shader, "tex", 0);
+    }
+
+    { // Blur init:
+        array_init(&blur_vertices, mem_root);
+        glCreateBuffers(1, &blur_VBO);
+        glCreateVertexArrays(1, &blur_VAO);
+        glVertexArrayVertexBuffer(blur_VAO, 0, blur_VBO, 0, sizeof(AElem(&blur_vertices)));
+        ATTR(blur_VAO, 0, AElem(&blur_vertices), 0, 2, pos);
+    }
+}
+
+Void win_init (CString title, DrBackend backend) {
+    software = (backend == DR_BACKEND_SOFTWARE);
+    SDL_Init(SDL_INIT_VIDEO);
+
+    if (software) {
+        window = SDL_CreateWindow(title, win_width, win_height, SDL_WINDOW_RESIZABLE);
+    } else {
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 5);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+        window = SDL_CreateWindow(title, win_width, win_height, SDL_WINDOW_OPENGL|SDL_WINDOW_RESIZABLE);
+        gl_ctx = SDL_GL_CreateContext(window);
+        gladLoadGLLoader((GLADloadproc)SDL_GL_GetProcAddress);
+        SDL_GL_SetSwapInterval(1); // The pacer assumes vsync.
+    }
 
-        glUseProgram(screen_shader);
-        set_int(screen_shader, "tex", 0);
+    SDL_StartTextInput(window);
+    wake_event = SDL_RegisterEvents(1);
+    pacer_init();
+
+    ring_init(RING_REGION_CAPACITY);
+    recorder_init(&main_recorder, mem_root);
+    array_init(&sorted_cmds, mem_root);
+    array_init(&batches, mem_root);
+
+    for (U32 c = SDL_SYSTEM_CURSOR_DEFAULT; c < SDL_SYSTEM_CURSOR_COUNT; ++c) {
+        cursors[c] = SDL_CreateSystemCursor(c);
     }
 
-    array_init(&blur_vertices, mem_root);
-    glGenVertexArrays(1, &blur_VAO);
-    glBindVertexArray(blur_VAO);
-    glGenBuffers(1, &blur_VBO);
-    ATTR(AElem(&blur_vertices), 0, 2, pos);
-    glBindVertexArray(0);
+    if (software) sw_init(os_get_proc_count());
+    else          gl_init();
 
-    array_init(&vertices, mem_root);
     array_init(&events, mem_root);
     update_projection();
+    resize_pending = true;
+    update_render_targets();
+}
+
+static Bool show_stats;
+
+Void win_show_stats (Bool enable) {
+    show_stats = enable;
 }
 
 Void win_run (Void (*frame)(F64 dt)) {
@@ -616,7 +2896,7 @@ Void win_run (Void (*frame)(F64 dt)) {
 
         log_scope(ls, 1);
 
-        #if 0
+        if (show_stats) {
             static U64 fps_last_counter = 0;
             static U64 fps_frame_count  = 0;
 
@@ -627,49 +2907,90 @@ Void win_run (Void (*frame)(F64 dt)) {
             if (elapsed >= 0.5) {
                 tmem_new(tm);
                 F64 fps = cast(F64, fps_frame_count) / elapsed;
-                SDL_SetWindowTitle(window, astr_fmt(tm, "fps: %.1f%c", fps, 0).data);
+                U64 kb = last_frame_stats.bytes_uploaded / KB;
+                U64 kb_as_vertices = last_frame_stats.bytes_uploaded_as_vertices / KB;
+                F64 skipped = 100.0 * frames_skipped / max(1, frames_skipped + frames_presented);
+                FrameLatency latency = win_get_latency();
+                SDL_SetWindowTitle(window, astr_fmt(tm, "fps: %.1f upload: %" PRIu64 "KB (%" PRIu64 "KB as vertices) skipped: %.1f%% latency p50/p90/p99: %.1f/%.1f/%.1fms%c", fps, kb, kb_as_vertices, skipped, latency.p50, latency.p90, latency.p99, 0).data);
                 fps_frame_count  = 0;
                 fps_last_counter = now;
             }
-        #endif
+        }
 
         SDL_Event event;
-        if (poll_events > 0 || ui_is_animating()) {
-            while (SDL_PollEvent(&event)) process_event(&event, &running);
+        if (poll_events > 0 || ui_is_animating() || image_uploads.count) {
+            pacer_wait();
+            while (SDL_PollEvent(&event)) handle_event(&event, &running);
             poll_events--;
         } else {
+            if (frame_dump_path && frame_dump_ready()) {
+                finish_frame_dump();
+                break;
+            }
+
             SDL_WaitEvent(&event);
-            do process_event(&event, &running); while (SDL_PollEvent(&event));
+            handle_event(&event, &running);
+            pacer_wait();
+            while (SDL_PollEvent(&event)) handle_event(&event, &running);
             poll_events = 4;
             now = SDL_GetPerformanceCounter();
         }
 
-        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-        glClearColor(0, 0, 0, 1);
-        glClear(GL_COLOR_BUFFER_BIT);
+        pacer.current.build = SDL_GetTicksNS();
+        upload_images();
 
         if (events.count == 0) array_push_lit(&events, .tag=EVENT_DUMMY);
         frame(dt);
         events.count = 0;
-        if (vertices.count) dr_flush_vertices();
 
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT);
-        glUseProgram(screen_shader);
-        glBindVertexArray(screen_VAO);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, framebuffer_tex);
-        glDrawArrays(GL_TRIANGLES, 0, screen_vertices.count);
+        Bool skip = !present_needed && !damage_everything && (main_recorder.hash == last_frame_hash);
+        last_frame_hash = main_recorder.hash;
 
-        SDL_GL_SwapWindow(window);
+        if (skip) {
+            discard_frame();
+            frames_skipped++;
+            pacer_frame_end(SDL_GetTicksNS(), false);
+        } else {
+            update_render_targets();
+            pacer.current.submit = SDL_GetTicksNS();
+
+            if (software) submit_frame_sw();
+            else          submit_frame();
+
+            ring_next_region();
+            U64 work_end = SDL_GetTicksNS();
+
+            if (software) present_frame_sw();
+            else          present_frame();
+
+            pacer_frame_end(work_end, true);
+            present_needed = false;
+            frames_presented++;
+            render_target_trim();
+        }
+
+        frame_stats.frames_presented = frames_presented;
+        frame_stats.frames_skipped = frames_skipped;
+        last_frame_stats = frame_stats;
+        frame_stats = (DrFrameStats){
+            .render_target_bytes  = frame_stats.render_target_bytes,
+            .render_target_allocs = frame_stats.render_target_allocs,
+            .frames_direct        = frame_stats.frames_direct,
+        };
+    }
+
+    if (! software) {
+        glDeleteVertexArrays(1, &VAO);
+        glDeleteVertexArrays(1, &glyph_VAO);
+        glUnmapNamedBuffer(ring.id);
+        glDeleteBuffers(1, &ring.id);
+        glDeleteBuffers(1, &quad_VBO);
+        for (U64 i = 0; i < DR_PIPELINE_COUNT; ++i) glDeleteProgram(pipeline_shaders[i].id);
+        glDeleteProgram(screen_shader.id);
+        glDeleteProgram(blur_shader.id);
+        SDL_GL_DestroyContext(gl_ctx);
     }
 
-    glDeleteVertexArrays(1, &VAO);
-    glDeleteBuffers(1, &VBO);
-    glDeleteProgram(rect_shader);
-    glDeleteProgram(screen_shader);
-    SDL_GL_DestroyContext(gl_ctx);
     SDL_DestroyWindow(window);
     SDL_Quit();
 }
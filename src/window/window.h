@@ -134,13 +134,50 @@ ienum (MouseCursor, U32) {
     MOUSE_CURSOR_W_RESIZE,
 };
 
-Void        win_init               (CString);
+ienum (DrBackend, U8) {
+    DR_BACKEND_GL,
+    DR_BACKEND_SOFTWARE, // Renders on the CPU. See window/software.h.
+};
+
+Void        win_init               (CString, DrBackend);
 Void        win_run                (Void (*)(F64 dt));
 SliceEvent *win_get_events         ();
 Void        win_set_clipboard_text (String);
 String      win_get_clipboard_text (Mem *);
 Vec2        win_get_size           ();
 Void        win_set_cursor         (MouseCursor);
+Void        win_wake               (); // Makes win_run() build a frame if it's waiting for input. Thread safe.
+Void        win_show_stats         (Bool); // Shows fps, upload size, skipped frames and latency in the title.
+Void        win_dump_frame         (CString path); // Makes win_run() write the frame to a PNG and return once it would wait for input.
+Void        win_compare_frame      (CString path); // Like win_dump_frame() but compares the frame with a PNG instead.
+Bool        win_frame_matched      (); // False if the compared frame differed or the dump failed.
+
+// Timestamps of one iteration of the loop in win_run() in the
+// nanoseconds of SDL_GetTicksNS(). The event is the arrival of
+// the oldest input event the frame consumed, or 0 if there was
+// none. The present is when the swap returned, or 0 if the frame
+// was skipped for being identical to the previous one.
+istruct (FrameTiming) {
+    U64 event;
+    U64 build;
+    U64 submit;
+    U64 present;
+};
+
+// Input to photon latency in milliseconds (event to present) of
+// the last WIN_TIMING_HISTORY frames that had input and were
+// presented.
+istruct (FrameLatency) {
+    U64 samples;
+    F64 p50;
+    F64 p90;
+    F64 p99;
+};
+
+#define WIN_TIMING_HISTORY 256
+
+FrameTiming  win_get_frame_timing   (); // Of the last frame.
+FrameLatency win_get_latency        ();
 
 // =============================================================================
 // Drawing:
@@ -153,6 +190,7 @@ istruct (Rect) {
 istruct (RectAttributes) {
     Vec4 color;
     Vec4 color2; // If x = -1, no gradient.
+    Bool horizontal_gradient; // Color on the left and color2 on the right.
     Vec2 top_left;
     Vec2 bottom_right;
     Vec4 radius;
@@ -169,23 +207,59 @@ istruct (RectAttributes) {
     F32 text_is_grayscale;
 };
 
-istruct (Vertex) {
-    Vec2 position;
-    Vec4 color;
+// This is what gets uploaded to the GPU for each rect. The
+// vertex shader expands it into a quad by reading it once per
+// corner of a static unit quad. The colors are packed RGBA8.
+istruct (RectInstance) {
     Vec2 top_left;
     Vec2 bottom_right;
     Vec4 radius;
-    F32 edge_softness;
-    Vec4 border_color;
     Vec4 border_widths;
-    Vec4 inset_shadow_color;
-    Vec4 outset_shadow_color;
-    F32 outset_shadow_width;
-    F32 inset_shadow_width;
+    Vec4 texture_rect;
     Vec2 shadow_offsets;
-    Vec2 uv;
-    Vec4 text_color;
-    F32 text_is_grayscale;
+    F32  edge_softness;
+    F32  outset_shadow_width;
+    F32  inset_shadow_width;
+    F32  text_is_grayscale;
+    U32  colors[4]; // Top left, bottom left, bottom right, top right.
+    U32  border_color;
+    U32  inset_shadow_color;
+    U32  outset_shadow_color;
+    U32  text_color;
+    U32  texture_slot; // Index into the textures bound for the batch.
+};
+
+array_typedef(RectInstance, RectInstance);
+
+// Glyphs are drawn with a pipeline of their own that only reads
+// this much per glyph. The quad has the size of the atlas rect
+// and the texture is the one bound with dr_bind_texture().
+istruct (GlyphInstance) {
+    Vec2 top_left;      // In GL coordinates.
+    U16  atlas_rect[4]; // x, y, width, height in texels.
+    U32  color;         // Packed RGBA8.
+    U32  flags;         // Texture slot in the low byte and GLYPH_GRAYSCALE.
+};
+
+#define GLYPH_GRAYSCALE (1u << 8) // Multiply the texture with the color.
+
+array_typedef(GlyphInstance, GlyphInstance);
+
+istruct (DrFrameStats) {
+    U64 rects;
+    U64 glyphs; // Drawn with the glyph pipeline. Not included in rects.
+    U64 draw_calls;
+    U64 bytes_uploaded;
+    U64 bytes_uploaded_as_vertices; // What the same rects and glyphs cost as 6 vertices each.
+    U64 gl_calls_issued; // State changes and uniform uploads.
+    U64 gl_calls_elided; // Those that were skipped as redundant.
+    U64 pixels_redrawn; // Area of the damaged region.
+    U64 frames_presented; // Total since startup.
+    U64 frames_skipped; // Total of frames identical to the previous one.
+    U64 render_target_bytes; // Held by the render target pool.
+    U64 render_target_allocs; // Total since startup.
+    U64 batches_merged; // DR_CMD_RECTS appended to an earlier batch when sorting.
+    U64 frames_direct; // Total drawn straight into the window. See submit_frame().
 };
 
 istruct (Texture) {
@@ -194,17 +268,109 @@ istruct (Texture) {
     F32 height;
 };
 
-array_typedef(Vertex, Vertex);
+// The framebuffer is retained between frames. Each frame only
+// the area given to dr_set_damage() is cleared and redrawn. If
+// it's not called during a frame, everything is redrawn. Frames
+// without blurs that damage most of the window are drawn right
+// into the window and redraw all of it.
+//
+// Everything drawn between dr_hash_begin() and dr_hash_end()
+// gets hashed, and the bounding box of it is reported. This is
+// how the ui finds out which boxes changed since last frame.
+Void          dr_set_damage        (Rect);
+Void          dr_hash_begin        ();
+U64           dr_hash_end          (Rect *out_bounds);
+F32           dr_blur_margin       (F32 strength);
+Void          dr_flush_vertices    ();
+RectInstance *dr_reserve_rects     (U32 n);
+RectInstance *dr_rect_fn           (RectAttributes *);
+Void          dr_glyph             (Vec2 top_left, U16 atlas_x, U16 atlas_y, U16 w, U16 h, Vec4 color, Bool grayscale);
+Void          dr_blur              (Rect, F32 strength, Vec4 corner_radius);
+Void          dr_scissor           (Rect);
+Void          dr_bind_texture      (Texture *);
+Texture       dr_2d_texture_alloc  (U32 w, U32 h);
+Void          dr_2d_texture_update (Texture *, U32 x, U32 y, U32 w, U32 h, U8 *buf);
+DrFrameStats *dr_get_frame_stats   (); // Of the last presented frame.
+Void          dr_dump_cmds         (); // Logs the command list of the next submitted frame before and after sorting.
+
+// GPU time of the passes of a presented frame, measured with
+// timer queries when enabled with dr_gpu_profile(). The label is
+// the one set with dr_label() when the pass was recorded. Only
+// the GL backend can be profiled.
+ienum (DrPass, U8) {
+    DR_PASS_RECTS,
+    DR_PASS_GLYPHS,
+    DR_PASS_BLUR,
+    DR_PASS_COMPOSITE, // Copying the frame to the window.
+    DR_PASS_COUNT,
+};
+
+istruct (DrGpuTiming) {
+    DrPass pass;
+    String label;
+    F64 ms;
+};
+
+array_typedef(DrGpuTiming, DrGpuTiming);
+
+Void             dr_gpu_profile      (Bool enable);
+Void             dr_label            (String); // For the commands recorded after it on this thread. No-op unless profiling.
+SliceDrGpuTiming dr_get_gpu_timings  (); // Of the last frame whose queries were read back.
+Void             dr_log_gpu_timings  (); // Logs a summary of the timings if there are new ones.
+
+// Images loaded with dr_image_load() are decoded on a thread
+// pool and uploaded on the main thread between frames, at most
+// DR_IMAGE_UPLOAD_BUDGET bytes per frame. The handle stays valid
+// forever. Once its state is DR_IMAGE_READY the size is known,
+// and dr_image_texture() returns the texture to draw it with at
+// the given width. That is a downscaled variant of the image if
+// one is big enough, and it is decoded the first time it's asked
+// for. Until it's resident another variant or NULL is returned.
+//
+// Variants that weren't asked for during a frame can be evicted
+// before the next one. See the Async images section of window.c.
+#define DR_IMAGE_UPLOAD_BUDGET  (4*MB)
+#define DR_IMAGE_TEXTURE_BUDGET (256*MB) // Default for dr_image_budget().
+
+ienum (DrImageState, U8) {
+    DR_IMAGE_LOADING,
+    DR_IMAGE_READY,
+    DR_IMAGE_FAILED,
+};
+
+istruct (DrImage) {
+    DrImageState state;
+    U32 width;
+    U32 height;
+};
+
+istruct (DrImageStats) {
+    U64 texture_bytes; // Of the resident variants including mipmaps.
+    U64 budget;
+    U64 variants; // Resident.
+    U64 evictions; // Total since startup.
+    U64 pending; // Jobs being decoded or uploaded.
+};
+
+DrImage      *dr_image_load      (CString filepath, Bool flip);
+Texture      *dr_image_texture   (DrImage *, F32 width); // Call it every frame the image is drawn.
+Void          dr_image_budget    (U64 bytes);
+DrImageStats *dr_get_image_stats ();
+
+// By default the dr_* functions record into the frame that gets
+// submitted at the end of win_run's frame callback. A thread can
+// record into its own DrRecorder between dr_record_begin() and
+// dr_record_end() instead, and the main thread then appends the
+// recorders to the frame with dr_splice() in the order given,
+// keeping the order the commands were recorded in. Texture
+// updates may only be recorded into the main thread's recorder,
+// and textures must be created on the main thread.
+istruct (DrRecorder);
 
-Void        dr_flush_vertices    ();
-Vertex     *dr_reserve_vertices  (U32 n);
-SliceVertex dr_rect_fn           (RectAttributes *);
-Void        dr_blur              (Rect, F32 strength, Vec4 corner_radius);
-Void        dr_scissor           (Rect);
-Texture     dr_image             (CString filepath, Bool flip);
-Void        dr_bind_texture      (Texture *);
-Texture     dr_2d_texture_alloc  (U32 w, U32 h);
-Void        dr_2d_texture_update (Texture *, U32 x, U32 y, U32 w, U32 h, U8 *buf);
+DrRecorder   *dr_recorder_new      (Mem *);
+Void          dr_record_begin      (DrRecorder *);
+Void          dr_record_end        ();
+Void          dr_splice            (DrRecorder **, U64 count);
 
 #define dr_rect(...)\
     dr_rect_fn(&(RectAttributes){__VA_ARGS__})